@@ -23,3 +23,17 @@ lua tests/$TEST.lua > tests/out/$TEST.txt
 TEST=wfc
 lua tests/$TEST.lua > tests/out/$TEST.txt
 
+# the parts that depend on the C library malloc or on the clock are masked
+# as in run.sh
+TEST=gc
+lua tests/$TEST.lua | sed -e 's/^\(  [0-9][0-9]*\) [0-9][0-9]*\.[0-9][0-9]*:/\1 -:/' -e 's/seconds=[0-9][0-9.]*/seconds=-/' -f tests/$TEST.sed > tests/out/$TEST.txt
+
+TEST=leaks
+lua tests/$TEST.lua > tests/out/$TEST.txt
+
+TEST=reallocs
+lua tests/$TEST.lua | sed 's/^Reallocs In Place: .*/Reallocs In Place: .../' > tests/out/$TEST.txt
+
+TEST=timeline
+lua tests/$TEST.lua | sed 's/^\(  [0-9][0-9]*\) [0-9][0-9]*\.[0-9][0-9]*:/\1 -:/' > tests/out/$TEST.txt
+
@@ -0,0 +1,31 @@
+-- See Copyright Notice in COPYRIGHT
+--
+-- Compares the cost of the allocation sites when the stack is walked on each
+-- malloc (sites) and when it is kept by hooks (sites + hook), running
+-- tests/wfc.lua. The reports go to the standard output and the times to the
+-- standard error, so run it from the repository root as:
+--   lua5.2 scripts/bench_sites.lua [depth] [runs] > /dev/null
+
+local depth = tonumber(arg[1]) or 8
+local runs = tonumber(arg[2]) or 5
+
+local configs = {
+  {name = "full, no sites", opt = {}},
+  {name = "sites (stack walk)", opt = {sites = depth}},
+  {name = "sites (hook)", opt = {sites = depth, hook = true}},
+}
+
+local wfc = assert(loadfile("tests/wfc.lua"))
+
+for _, c in ipairs(configs) do
+  local best = math.huge
+  for i = 1, runs do
+    collectgarbage()
+    local t = os.clock()
+    wfc(c.opt)
+    t = os.clock() - t
+    if t < best then best = t end
+  end
+  io.stderr:write(string.format("%-20s depth=%d best of %d: %.3f s\n",
+                                c.name, depth, runs, best))
+end
@@ -10,130 +10,689 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "lmp.h"
 #include "vmemory.h"
 #include "lmp_struct.h"
+#include "lmp_site.h"
+#include "lmp_output.h"
+#include "lmp_trace.h"
+#include "lmp_timeline.h"
+#include "lmp_gc.h"
 
 #define LMP_FREE 0
 #define LMP_MALLOC 1
 #define LMP_REALLOC 2
 
+/* size classes: log2 classes split in 2^SIZE_SUBBITS linear sub-classes */
+#define SIZE_SUBBITS 2
+#define SIZE_NCLASSES (32 << SIZE_SUBBITS)  /* last class takes the rest */
 
-/* STATIC VARIABLES */
-/* ac = allocation counter */
-static int ac_string, ac_function, ac_userdata, ac_thread, ac_table, ac_other;
+/* operations of the size class histograms */
+#define HIST_MALLOC 0
+#define HIST_GROW 1    /* realloc to a size not smaller than the old one */
+#define HIST_SHRINK 2
+#define HIST_FREE 3
+#define HIST_NOPS 4
+
+/*
+** buckets of the peak composition: types, then size classes, then sites
+*/
+#define PEAK_TYPE(t) ((unsigned int) (t))
+#define PEAK_CLASS(c) ((unsigned int) (LMP_NTYPES + (c)))
+#define PEAK_SITE(s) ((unsigned int) (LMP_NTYPES + SIZE_NCLASSES + (s)))
+#define PEAK_NFIXED (LMP_NTYPES + SIZE_NCLASSES)
+
+/* number of sites in the report */
+#define SITE_TOP 20
+
+/* maximum length of a site name in the output file */
+#define SITENAME_SIZE 1024
+
+/* number of (type, site) groups in the leak report */
+#define LEAK_TOP 20
+
+/* lifetime classes: age 0, then [2^(c-1), 2^c) mallocs; last takes the rest */
+#define LIFE_NCLASSES 40
+#define LIFE_YOUNG 10  /* classes up to LIFE_YOUNG (age < 2^LIFE_YOUNG) */
+
+/* classes of reallocs per block: 0, then [2^(c-1), 2^c); saturated last */
+#define RESIZE_NCLASSES 17
+
+/* counting filter of sampled addresses (LMP_MODE_SAMPLE) */
+#define FILTER_SIZE 65536
+#define FILTER_MAX 255  /* saturated counters are never decremented */
+
+
+/* blocks and their bytes in each class of reallocs per block */
+typedef struct lmp_resizes {
+  long blocks[RESIZE_NCLASSES];
+  long size[RESIZE_NCLASSES];
+} lmp_Resizes;
+
+
+/*
+** Profiler context of one lua_State. It is the ud of lmp_alloc, so each
+** profiled lua_State has independent counters and blocks.
+*/
+struct lmp_context {
+  lua_Alloc f;  /* lua_State original allocation function */
+  void *ud;     /* and its ud */
+  int mode;
+  int usegraphics;
+  int threadsafe;
+  int detail;
+  int leaks;  /* reports the blocks still alive at stop */
+  char *output;  /* file of the machine readable report (NULL if none) */
+  int outputformat;  /* LMP_OUTPUT_* */
+  lmp_Trace *trace;  /* binary trace of the operations (NULL if none) */
+  unsigned int lastsite;  /* site of the last malloc (for the trace) */
+  lmp_Timeline *timeline;  /* memory timeline (NULL if none) */
+  lmp_GC *gc;        /* garbage collection cycles (NULL if none) */
+
+  /* reallocs that kept or moved the block (option reallocs) */
+  int reallocs;
+  long ingrows, inshrinks;
+  long movegrows, moveshrinks;
+  long copysize;         /* bytes copied by the moves */
+  lmp_Resizes resized;   /* freed blocks by number of reallocs */
+
+  /*
+  ** composition of the live memory at the peak (option peak). The peak
+  ** values of a bucket (type, size class or site) are copied from its live
+  ** values only when a new peak is reached, and only if the bucket changed
+  ** since the previous peak: each bucket is listed in 'changed' the first
+  ** time it changes in a peak epoch (its stamp says if it is listed).
+  */
+  int peak;
+  lmp_Live liveclasses[SIZE_NCLASSES];  /* blocks alive in each class */
+  lmp_Live peaktotal;
+  lmp_Live peaktypes[LMP_NTYPES];
+  lmp_Live peakclasses[SIZE_NCLASSES];
+  long peaknops;      /* operations done at the peak */
+  unsigned long peakepoch;  /* incremented at each new peak */
+  unsigned long stamps[PEAK_NFIXED];  /* epochs of types and classes */
+  unsigned int *changed;  /* buckets changed in this epoch */
+  size_t nchanged;
+  size_t sizechanged;
+  pthread_mutex_t lock;  /* protects everything below (threadsafe only) */
+  struct lmp_context *next;  /* list of threadsafe contexts */
+  lmp_Hash *hash;  /* blocks (LMP_MODE_FULL and LMP_MODE_SAMPLE) */
+  lua_State *L;
+  int sitedepth;
+  lmp_Sites *sites;  /* allocation sites (NULL if sitedepth is 0) */
+  int sitehook;      /* sites come from the hook shadow stack */
+  lua_State *hookL;  /* thread of the last hook event (sitehook) */
+  long hookstale;    /* mallocs done when the hook was found replaced */
+  unsigned int nextsite;  /* site of the next malloc, if L is NULL */
+
+  /* hooks of L: lmp_hook is installed while sitehook is set */
+  int hookmask;      /* events used by the profiler */
+  lua_Hook prevhook; /* hook installed before (e.g. a debugger), chained */
+  int prevmask, prevcount;
+
+  /*
+  ** sampling: an allocation is sampled when it crosses the byte countdown,
+  ** which is reset with an exponential random value of mean sampleinterval
+  ** (i.e. a Poisson process over the allocated bytes). 'filter' counts the
+  ** sampled blocks by address hash, so a free of a block that was not
+  ** sampled is rejected in O(1) when its counter is zero.
+  */
+  long sampleinterval;
+  long countdown;
+  uint32_t rng;
+  unsigned char *filter;
+  double est_live;    /* unbiased estimation of live bytes */
+  double est_var;     /* and its variance */
+  double est_type[LMP_NTYPES];  /* estimated live bytes of each type */
 
-static long nallocs, alloc_size;
-static long nreallocs, realloc_size;
-static long nfrees, free_size;
-static long memoryuse, maxmemoryuse;
-static int Laddress;
-static int Maddress = 0;
-static int usegraphics;
+  lmp_TypeCounters types[LMP_NTYPES];  /* indexed by typeindex */
+  /* number of operations of each type in each size class (new size) */
+  long hist[HIST_NOPS][LMP_NTYPES][SIZE_NCLASSES];
+  /* freed blocks of each type in each lifetime class (LMP_MODE_FULL) */
+  long life[LMP_NTYPES][LIFE_NCLASSES];
+
+  long nallocs, alloc_size;
+  long nreallocs, realloc_size;
+  long grow_size;  /* bytes added by growing reallocs */
+  long nfrees, free_size;
+  long memoryuse, maxmemoryuse;
+  int Laddress;
+  int Maddress;
+};
 
 /* STATIC FUNCTIONS */
-static void *lmp_malloc(size_t nsize, size_t osize);
-static void *lmp_free(void *ptr);
-static void *lmp_realloc(void *ptr, size_t nsize);
-static void initcounters();
-static void updatecounters(int alloctype, size_t size, size_t luatype);
-static void generatereport();
+static void *lmp_malloc(lmp_Context *ctx, size_t nsize, size_t luatype);
+static void *lmp_free(lmp_Context *ctx, void *ptr, size_t osize);
+static void *lmp_realloc(lmp_Context *ctx, void *ptr, size_t osize,
+                                                      size_t nsize);
+static void *lmp_countalloc(lmp_Context *ctx, void *ptr, size_t osize,
+                                                         size_t nsize);
+static void *lmp_samplealloc(lmp_Context *ctx, void *ptr, size_t osize,
+                                                          size_t nsize);
+static void nextsample(lmp_Context *ctx);
+static void updatecounters(lmp_Context *ctx, int alloctype, size_t osize,
+                                           size_t nsize, size_t luatype);
+static void printcounters(lmp_Context *ctx);
+static void printdetail(lmp_Context *ctx);
+static void updatelifetime(lmp_Context *ctx, size_t luatype,
+                                             unsigned long age);
+static void updatesite(lmp_Context *ctx, lmp_Block *block, long n,
+                                                           long size);
+static void printsites(lmp_Context *ctx);
+static void printleaks(lmp_Context *ctx);
+static void printtimeline(lmp_Context *ctx);
+static void printpeak(lmp_Context *ctx);
+static void printgc(lmp_Context *ctx);
+static void printreallocs(lmp_Context *ctx);
+static void updaterealloc(lmp_Context *ctx, lmp_Block *block, int moved,
+                                            size_t osize, size_t nsize);
+static void countresizes(lmp_Block *block, void *ud);
+static void changed(lmp_Context *ctx, unsigned int bucket,
+                                      unsigned long *stamp);
+static void commitpeak(lmp_Context *ctx);
+static void writereport(lmp_Context *ctx);
+static void traceop(lmp_Context *ctx, void *ptr, size_t osize, size_t nsize,
+                                                                void *p);
+static void sethook(lmp_Context *ctx, int mask);
+static void unsethook(lmp_Context *ctx);
+static void generatereport(lmp_Context *ctx);
+
+/* STATIC VARIABLES */
+/* running threadsafe contexts. the lock is never taken by lmp_alloc */
+static pthread_mutex_t contextslock = PTHREAD_MUTEX_INITIALIZER;
+static lmp_Context *contexts = NULL;
+
+/* names of the type categories, by typeindex */
+static const char *const typenames[LMP_NTYPES] = {
+  "String", "Function", "Userdata", "Thread", "Table", "Other"
+};
 
 /* PUBLIC FUNCTIONS */
-void lmp_start(int lowestaddress, float memused, int usegraphic) {
-  initcounters();
-  st_newhash(usegraphic);
-  usegraphics = usegraphic;
-  Laddress = lowestaddress;  /* save lowest address to calc mem needed */
-  if (usegraphics)
-    vm_start(lowestaddress, memused);
+lmp_Context *lmp_start(int lowestaddress, lmp_Options *opt, lua_Alloc f,
+                                                             void *ud) {
+  /* zeroed memory: all counters start at 0 */
+  lmp_Context *ctx = (lmp_Context *) st_rawalloc(sizeof(lmp_Context));
+  ctx->f = f;
+  ctx->ud = ud;
+  ctx->mode = opt->mode;
+  ctx->usegraphics = opt->usegraphics;
+  ctx->threadsafe = opt->threadsafe;
+  ctx->detail = opt->detail;
+  ctx->leaks = (opt->leaks && ctx->mode == LMP_MODE_FULL);
+  ctx->peak = (opt->peak && ctx->mode == LMP_MODE_FULL);
+  ctx->peakepoch = 1;  /* zeroed stamps are not in the epoch */
+  ctx->reallocs = (opt->reallocs && ctx->mode == LMP_MODE_FULL);
+  ctx->L = opt->L;
+  if (opt->output != NULL) {
+    ctx->output = (char *) st_rawalloc(strlen(opt->output) + 1);
+    strcpy(ctx->output, opt->output);
+    ctx->outputformat = opt->outputformat;
+  }
+  if (ctx->mode == LMP_MODE_FULL && opt->sitedepth > 0) {
+    ctx->sitedepth = opt->sitedepth < LMP_SITE_MAXDEPTH ? opt->sitedepth
+                                                        : LMP_SITE_MAXDEPTH;
+    ctx->sites = si_new();
+    if (opt->sitehook) {
+      ctx->sitehook = 1;
+      ctx->hookL = ctx->L;
+      si_initshadow(ctx->sites, ctx->L);
+      sethook(ctx, LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE);
+    }
+  }
+  if (ctx->mode != LMP_MODE_COUNTERS)
+    ctx->hash = st_newhash(ctx->usegraphics);
+  if (opt->trace != NULL) {
+    ctx->trace = tr_open(opt->trace, ctx->sites ? LMP_TRACE_SITES : 0,
+                         opt->tracepolicy);
+    if (ctx->trace == NULL)
+      fprintf(stderr, "luamemprofiler: cannot open %s\n", opt->trace);
+  }
+  if (opt->timeline > 0 || opt->timelinems > 0)
+    ctx->timeline = tl_new(opt->timeline, opt->timelinems);
+  if (opt->gc)
+    ctx->gc = gc_new();
+  if (ctx->mode == LMP_MODE_SAMPLE) {
+    ctx->sampleinterval = opt->sampleinterval > 0 ? opt->sampleinterval
+                                                  : LMP_SAMPLE_INTERVAL;
+    ctx->rng = ((uint32_t) time(NULL) ^ (uint32_t) (uintptr_t) ctx) | 1;
+    ctx->filter = (unsigned char *) st_rawalloc(FILTER_SIZE);
+    ctx->countdown = 0;
+    nextsample(ctx);
+  }
+  ctx->Laddress = lowestaddress;  /* save lowest address to calc mem needed */
+  if (ctx->usegraphics)
+    vm_start(lowestaddress, opt->memused);
+
+  if (ctx->threadsafe) {
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_mutex_lock(&contextslock);
+    ctx->next = contexts;
+    contexts = ctx;
+    pthread_mutex_unlock(&contextslock);
+  }
+  return ctx;
 }
 
-void lmp_stop() {
-  generatereport();
+void lmp_stop(lmp_Context *ctx) {
+  if (ctx->threadsafe) {  /* unregister, so lmp_report cannot see it */
+    lmp_Context **p;
+    pthread_mutex_lock(&contextslock);
+    for (p = &contexts; *p != ctx; p = &(*p)->next) ;
+    *p = ctx->next;
+    pthread_mutex_unlock(&contextslock);
+    pthread_mutex_destroy(&ctx->lock);
+  }
+
+  generatereport(ctx);
+  if (ctx->output != NULL) {
+    writereport(ctx);
+    st_rawfree(ctx->output, strlen(ctx->output) + 1);
+  }
+
+  if (ctx->trace != NULL)
+    tr_close(ctx->trace);
+  if (ctx->timeline != NULL)
+    tl_destroy(ctx->timeline);
+  if (ctx->gc != NULL)
+    gc_destroy(ctx->gc);
+  if (ctx->changed != NULL)
+    st_rawfree(ctx->changed, ctx->sizechanged * sizeof(unsigned int));
 
   /* erase counters and blocks */
-  initcounters();
-  st_destroyhash();
-  if (usegraphics)
+  if (ctx->sitehook)
+    unsethook(ctx);
+  if (ctx->sites != NULL)
+    si_destroy(ctx->sites);
+  if (ctx->mode != LMP_MODE_COUNTERS)
+    st_destroyhash(ctx->hash);
+  if (ctx->mode == LMP_MODE_SAMPLE)
+    st_rawfree(ctx->filter, FILTER_SIZE);
+  if (ctx->usegraphics)
     vm_stop();
+  st_rawfree(ctx, sizeof(lmp_Context));
+}
+
+int lmp_report (lmp_Stats *st) {
+  lmp_Context sum;
+  lmp_Context *ctx;
+  int i, n = 0;
+
+  memset(&sum, 0, sizeof(lmp_Context));
+  pthread_mutex_lock(&contextslock);
+  for (ctx = contexts; ctx != NULL; ctx = ctx->next) {
+    pthread_mutex_lock(&ctx->lock);
+    for (i = 0; i < LMP_NTYPES; i++) {
+      sum.types[i].nallocs += ctx->types[i].nallocs;
+      sum.types[i].live += ctx->types[i].live;
+      sum.types[i].livesize += ctx->types[i].livesize;
+      sum.types[i].maxlive += ctx->types[i].maxlive;
+      sum.types[i].maxlivesize += ctx->types[i].maxlivesize;
+    }
+    for (i = 0; i < HIST_NOPS * LMP_NTYPES * SIZE_NCLASSES; i++)
+      (&sum.hist[0][0][0])[i] += (&ctx->hist[0][0][0])[i];
+    for (i = 0; i < LMP_NTYPES * LIFE_NCLASSES; i++)
+      (&sum.life[0][0])[i] += (&ctx->life[0][0])[i];
+    sum.detail = sum.detail || ctx->detail;
+    sum.nallocs += ctx->nallocs;
+    sum.alloc_size += ctx->alloc_size;
+    sum.nreallocs += ctx->nreallocs;
+    sum.realloc_size += ctx->realloc_size;
+    sum.nfrees += ctx->nfrees;
+    sum.free_size += ctx->free_size;
+    sum.memoryuse += ctx->memoryuse;
+    sum.maxmemoryuse += ctx->maxmemoryuse;  /* sum of maxima, not a peak */
+    pthread_mutex_unlock(&ctx->lock);
+    n++;
+  }
+  pthread_mutex_unlock(&contextslock);
+
+printf("===================================================================\n");
+printf("Merged Report of %d lua_States\n", n);
+  printcounters(&sum);
+printf("\nSum of the Maximum Memory Used of Each lua_State=%ld bytes\n", sum.maxmemoryuse);
+  if (sum.detail)
+    printdetail(&sum);
+printf("===================================================================\n");
+  st->nallocs = sum.nallocs;
+  st->alloc_size = sum.alloc_size;
+  st->nreallocs = sum.nreallocs;
+  st->realloc_size = sum.realloc_size;
+  st->nfrees = sum.nfrees;
+  st->free_size = sum.free_size;
+  st->memoryuse = sum.memoryuse;
+  st->maxmemoryuse = sum.maxmemoryuse;
+  memcpy(st->types, sum.types, sizeof(sum.types));
+  return n;
+}
+
+void lmp_gettypes (lmp_Context *ctx, lmp_TypeCounters *tc) {
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  memcpy(tc, ctx->types, sizeof(ctx->types));
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void lmp_getstats (lmp_Context *ctx, lmp_Stats *st) {
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  st->nallocs = ctx->nallocs;
+  st->alloc_size = ctx->alloc_size;
+  st->nreallocs = ctx->nreallocs;
+  st->realloc_size = ctx->realloc_size;
+  st->nfrees = ctx->nfrees;
+  st->free_size = ctx->free_size;
+  st->memoryuse = ctx->memoryuse;
+  st->maxmemoryuse = ctx->maxmemoryuse;
+  memcpy(st->types, ctx->types, sizeof(ctx->types));
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+unsigned int lmp_nsites (lmp_Context *ctx) {
+  unsigned int n = 0;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  if (ctx->sites != NULL)
+    n = si_count(ctx->sites);
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+  return n;
+}
+
+unsigned int lmp_snapshot (lmp_Context *ctx, lmp_Live *total,
+                lmp_Live *types, lmp_Live *sites, unsigned int nsites) {
+  unsigned int i;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  total->live = ctx->nallocs - ctx->nfrees;
+  total->livesize = ctx->memoryuse;
+  for (i = 0; i < LMP_NTYPES; i++) {
+    types[i].live = ctx->types[i].live;
+    types[i].livesize = ctx->types[i].livesize;
+  }
+  if (ctx->sites == NULL)
+    nsites = 0;
+  else if (nsites > si_count(ctx->sites))
+    nsites = si_count(ctx->sites);
+  for (i = 0; i < nsites; i++) {
+    lmp_Site *site = si_get(ctx->sites, i);
+    sites[i].live = site->live;
+    sites[i].livesize = site->livesize;
+  }
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+  return nsites;
+}
+
+unsigned int lmp_definesite (lmp_Context *ctx, unsigned int parent,
+                                               const char *where) {
+  unsigned int id;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  id = si_define(ctx->sites, parent, where);
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+  return id;
+}
+
+void lmp_setsite (lmp_Context *ctx, unsigned int site) {
+  ctx->nextsite = site;
+}
+
+int lmp_mark (lmp_Context *ctx, const char *label) {
+  if (ctx->timeline == NULL)
+    return 0;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  tl_mark(ctx->timeline, label, ctx->nallocs + ctx->nreallocs + ctx->nfrees,
+          ctx->memoryuse);
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+  return 1;
 }
 
-/* allocation function used by Lua when luamemprofiler is used */
+int lmp_gettimeline (lmp_Context *ctx, lmp_TimePoint *points,
+                     lmp_TimeMark *marks, int *nmarks, long *interval,
+                                                       int *clock) {
+  int n;
+  if (ctx->timeline == NULL)
+    return 0;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  n = tl_points(ctx->timeline, points,
+                ctx->nallocs + ctx->nreallocs + ctx->nfrees, ctx->memoryuse,
+                ctx->types);
+  *nmarks = tl_marks(ctx->timeline, marks);
+  *interval = tl_interval(ctx->timeline, clock);
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+  return n;
+}
+
+void lmp_gccycle (lmp_Context *ctx) {
+  if (ctx->gc == NULL)
+    return;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  gc_cycle(ctx->gc, ctx->alloc_size + ctx->grow_size,
+           ctx->free_size + ctx->grow_size - ctx->realloc_size,
+           ctx->nallocs - ctx->nfrees, ctx->memoryuse);
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void lmp_sitename (lmp_Context *ctx, unsigned int site, char *buf,
+                                                        size_t size) {
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
+  si_tostring(ctx->sites, site, buf, size);
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+** allocation function used by Lua when luamemprofiler is used. ud is the
+** lua_State profiler context. Threadsafe contexts are locked during the
+** operation; the lock is private to the lua_State, so it is only contended
+** while lmp_report reads the counters.
+*/
 void *lmp_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
-  (void) ud;
-  (void) osize;
+  lmp_Context *ctx = (lmp_Context *) ud;
+  void *p;
+  if (ctx->threadsafe)
+    pthread_mutex_lock(&ctx->lock);
 
-  if (nsize == 0) {  /* calls our malloc, free or realloc functions */
-    return lmp_free(ptr);
+  if (ctx->mode == LMP_MODE_COUNTERS) {
+    p = lmp_countalloc(ctx, ptr, osize, nsize);
+  } else if (ctx->mode == LMP_MODE_SAMPLE) {
+    p = lmp_samplealloc(ctx, ptr, osize, nsize);
+  } else if (nsize == 0) {  /* calls our malloc, free or realloc functions */
+    p = lmp_free(ctx, ptr, osize);
   } else if (ptr == NULL) {
-    return lmp_malloc(nsize, osize);  /* osize is the lua_type */
+    p = lmp_malloc(ctx, nsize, osize);  /* osize is the lua_type */
   } else { 
-    return lmp_realloc(ptr, nsize);
+    p = lmp_realloc(ctx, ptr, osize, nsize);
   }
+  if (ctx->trace != NULL)
+    traceop(ctx, ptr, osize, nsize, p);
+  if (ctx->timeline != NULL)
+    tl_update(ctx->timeline, ctx->nallocs + ctx->nreallocs + ctx->nfrees,
+              ctx->memoryuse, ctx->types);
+  if (ctx->nchanged > 0 && ctx->memoryuse == ctx->maxmemoryuse)
+    commitpeak(ctx);
+  if (ctx->gc != NULL)
+    gc_update(ctx->gc, ctx->memoryuse);
+
+  if (ctx->threadsafe)
+    pthread_mutex_unlock(&ctx->lock);
+  return p;
 }
 
 /* STATIC FUNCTIONS */
 
-/* does normal malloc and then alloc and update other structures */
-static void *lmp_malloc(size_t nsize, size_t luatype) {
-  void *ptr = malloc(nsize); /* normal malloc */
-  lmp_Block *new = (lmp_Block *) malloc (sizeof(lmp_Block));
+/*
+** hook of the profiled lua_State. The context is the ud of the allocation
+** function, so it is found without any lookup. Coroutines created while
+** the hook is installed inherit it: their events do not change the shadow
+** stack (of the main thread), but they record the coroutine as the running
+** thread, so the sites of its mallocs are taken by walking its stack until
+** an event of the main thread (e.g. the return of coroutine.resume).
+*/
+static void lmp_hook (lua_State *L, lua_Debug *ar) {
+  lmp_Context *ctx;
+  void *ud;
+  int event;
+  if (lua_getallocf(L, &ud) != lmp_alloc)
+    return;  /* profiler stopped */
+  ctx = (lmp_Context *) ud;
+  if (ctx->sitehook) {
+    if (L == ctx->L)
+      si_hookevent(ctx->sites, L, ar);
+    ctx->hookL = L;
+  }
+  event = (ar->event == LUA_HOOKTAILCALL) ? LUA_HOOKCALL : ar->event;
+  if (ctx->prevhook != NULL && (ctx->prevmask & (1 << event)))
+    ctx->prevhook(L, ar);
+}
 
-  st_initblock(new, ptr, nsize, luatype);
-  st_insertblock(new);
+/*
+** installs lmp_hook for the events in 'mask'. The hook of the host (e.g. a
+** debugger) is kept and called by lmp_hook for its own events.
+*/
+static void sethook (lmp_Context *ctx, int mask) {
+  ctx->prevhook = lua_gethook(ctx->L);
+  ctx->prevmask = lua_gethookmask(ctx->L);
+  ctx->prevcount = lua_gethookcount(ctx->L);
+  ctx->hookmask = mask;
+  lua_sethook(ctx->L, lmp_hook, ctx->hookmask | ctx->prevmask,
+                                ctx->prevcount);
+}
 
-  updatecounters(LMP_MALLOC, nsize, luatype);
-  if ((uintptr_t) ptr > Maddress)  /* save max address to calc mem needed */
-    Maddress = (uintptr_t) ptr;
+/*
+** removes lmp_hook, restoring the previous hook. A hook installed by the
+** host after lmp_hook is left alone.
+*/
+static void unsethook (lmp_Context *ctx) {
+  if (lua_gethook(ctx->L) == lmp_hook)
+    lua_sethook(ctx->L, ctx->prevhook, ctx->prevmask, ctx->prevcount);
+  ctx->hookmask = 0;
+}
+
+/* maps a lua_type to its counter index (string, function, ..., other) */
+static int typeindex(size_t luatype) {
+  switch(luatype) {
+    case LUA_TSTRING:
+      return 0;
+    case LUA_TFUNCTION:
+      return 1;
+    case LUA_TUSERDATA:
+      return 2;
+    case LUA_TTHREAD:
+      return 3;
+    case LUA_TTABLE:
+      return 4;
+    default:
+      return 5;
+  }
+}
+
+/* does original malloc and then alloc and update other structures */
+static void *lmp_malloc(lmp_Context *ctx, size_t nsize, size_t luatype) {
+  lmp_Block *new;
+  unsigned int site = LMP_NOSITE;
+  void *ptr;
+  /* the stack is walked before the operation, while it is consistent */
+  if (ctx->sitehook && !ctx->hookstale && lua_gethook(ctx->L) != lmp_hook)
+    ctx->hookstale = ctx->nallocs + 1;  /* replaced: shadow stack is stale */
+  if (ctx->sitehook && !ctx->hookstale)
+    site = ctx->hookL == ctx->L ? si_current(ctx->sites, ctx->sitedepth)
+                        : si_capture(ctx->sites, ctx->hookL, ctx->sitedepth);
+  else if (ctx->sites != NULL)
+    site = ctx->L != NULL ? si_capture(ctx->sites, ctx->L, ctx->sitedepth)
+                          : ctx->nextsite;
+  ptr = ctx->f(ctx->ud, NULL, luatype, nsize); /* original malloc */
+  if (ptr == NULL) return NULL;
 
-  if (usegraphics)  /* if graphics enabled call function to handle */
+  ctx->lastsite = site;
+  new = st_newblock(ctx->hash);
+
+  st_initblock(ctx->hash, new, ptr, nsize, luatype);
+  st_insertblock(ctx->hash, new);
+
+  updatecounters(ctx, LMP_MALLOC, 0, nsize, luatype);
+  st_setbirth(new, ctx->nallocs);  /* age counts the mallocs that follow */
+  if (ctx->sites != NULL) {
+    st_setsite(new, site);
+    si_get(ctx->sites, site)->nallocs++;
+    updatesite(ctx, new, 1, (long) nsize);
+  }
+  /* save max address to calc mem needed */
+  if ((uintptr_t) ptr > ctx->Maddress)
+    ctx->Maddress = (uintptr_t) ptr;
+
+  if (ctx->usegraphics)  /* if graphics enabled call function to handle */
     vm_newmemop(LMP_VM_MALLOC, ptr, luatype, nsize);
 
   return ptr;
 }
 
-/* free and update other structures and then does normal free */
-static void *lmp_free(void *ptr) {
-  lmp_Block *block = st_removeblock(ptr);
+/* free and update other structures and then does original free */
+static void *lmp_free(lmp_Context *ctx, void *ptr, size_t osize) {
+  lmp_Block *block = st_removeblock(ctx->hash, ptr);
+  /* the last thread seen by the hook is collected (e.g. a coroutine that
+     ended with an error, so no return event came from the main thread) */
+  if (ctx->sitehook && (uintptr_t) ctx->hookL - (uintptr_t) ptr < osize)
+    ctx->hookL = ctx->L;
   if (block != NULL) {
     int size = st_getsize(block);
-    updatecounters(LMP_FREE, size, 0);
-    if (usegraphics) {  /* if graphics enabled call function to handle */
+    int luatype = st_getluatype(block);
+    updatecounters(ctx, LMP_FREE, size, 0, luatype);
+    updatelifetime(ctx, luatype, ctx->nallocs - st_getbirth(block));
+    if (ctx->reallocs)
+      countresizes(block, &ctx->resized);
+    if (ctx->sites != NULL)
+      updatesite(ctx, block, -1, -(long) size);
+    if (ctx->usegraphics) {  /* if graphics enabled call function to handle */
       vm_newmemop(LMP_VM_FREE, ptr, LUA_TFREE, size);
     }
-    free(block);
+    st_freeblock(ctx->hash, block);
   }
-  free(ptr);
-  return NULL;
+  return ctx->f(ctx->ud, ptr, osize, 0);
 }
 
 /* 
-** does normal realloc, assumes realloc always change object address (wich is
+** does original realloc, assumes realloc always change object address (wich is
 ** not true, but is simplier to program and costless) and updates block
 ** information. then, if usegraphics, verify if realloc is enlarging or
 ** shrinking and call vm_newop with the correct values. Optimise drawing if
 ** realloc uses same object address. Finally, update counters.
 */
 
-static void *lmp_realloc(void *ptr, size_t nsize) {
+static void *lmp_realloc(lmp_Context *ctx, void *ptr, size_t osize,
+                                                      size_t nsize) {
   lmp_Block *block;
-  size_t osize;
-  void *p = realloc(ptr, nsize);
+  void *p = ctx->f(ctx->ud, ptr, osize, nsize);
   if (p == NULL) return NULL;
 
-  block = st_removeblock(ptr);  /* realloc usually changes memory address */
+  /* realloc usually changes memory address */
+  block = st_removeblock(ctx->hash, ptr);
   if (block != NULL) {
     osize = st_getsize(block);
     st_setsize(block, nsize);
     st_setptr(block, p);
-    st_insertblock(block);
-    if (usegraphics) {
+    st_insertblock(ctx->hash, block);
+    if (ctx->usegraphics) {
       int luatype = st_getluatype(block);
       if (ptr != p) {  /* memory location changed */
         vm_newmemop(LMP_VM_REALLOC, ptr, LUA_TFREE, osize); /*erase old block*/
@@ -146,84 +705,1106 @@ static void *lmp_realloc(void *ptr, size_t nsize) {
         }
       }
     }
-    updatecounters(LMP_REALLOC, nsize - osize, 0);
+    updatecounters(ctx, LMP_REALLOC, osize, nsize, st_getluatype(block));
+    if (ctx->sites != NULL)
+      updatesite(ctx, block, 0, (long) nsize - (long) osize);
+    if (ctx->reallocs)
+      updaterealloc(ctx, block, ptr != p, osize, nsize);
   }
   return p;
 }
 
+/*
+** counters mode: no block structures at all. Lua (5.2 or greater) passes the
+** old block size in osize on free and realloc, and the block type in osize on
+** malloc. Note that frees and reallocs of blocks allocated before start are
+** counted too, since they cannot be told apart without the block table.
+*/
+static void *lmp_countalloc(lmp_Context *ctx, void *ptr, size_t osize,
+                                                         size_t nsize) {
+  if (nsize == 0) {
+    if (ptr != NULL)
+      updatecounters(ctx, LMP_FREE, osize, 0, 0);
+    return ctx->f(ctx->ud, ptr, osize, 0);
+  } else if (ptr == NULL) {
+    ptr = ctx->f(ctx->ud, NULL, osize, nsize);
+    if (ptr != NULL) {
+      /* osize is the lua_type */
+      updatecounters(ctx, LMP_MALLOC, 0, nsize, osize);
+      if ((uintptr_t) ptr > ctx->Maddress)
+        ctx->Maddress = (uintptr_t) ptr;
+    }
+    return ptr;
+  } else {
+    void *p = ctx->f(ctx->ud, ptr, osize, nsize);
+    if (p != NULL)
+      updatecounters(ctx, LMP_REALLOC, osize, nsize, 0);
+    return p;
+  }
+}
+
 /* STATIC FUNCTIONS */
-static void initcounters() {
-  ac_string=0;ac_function=0;ac_userdata=0;ac_thread=0;ac_table=0;ac_other=0;
-  nallocs=0;alloc_size=0;
-  nreallocs=0;realloc_size=0;
-  nfrees=0;free_size=0;
-  memoryuse=0;maxmemoryuse=0;
+
+/* draws the number of bytes until the next sample: exponential distribution */
+static void nextsample(lmp_Context *ctx) {
+  double u;
+  uint32_t x = ctx->rng;  /* xorshift32 */
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ctx->rng = x;
+  u = ((x >> 8) + 1) / 16777217.0;  /* uniform in (0, 1] */
+  ctx->countdown += (long) (-log(u) * ctx->sampleinterval) + 1;
 }
 
-/* check alloctype and update counters accordingly */
-static void updatecounters (int alloctype, size_t size, size_t luatype) {
+static size_t filterindex(void *ptr) {
+  uintptr_t k = (uintptr_t) ptr >> 3;
+  return (size_t) ((k ^ (k >> 16)) & (FILTER_SIZE - 1));
+}
+
+/*
+** updates the estimations with a sampled block of size 'size'. It was
+** sampled with probability p = 1 - exp(-size/interval), so it stands for
+** 1/p blocks (Horvitz-Thompson estimator). 'sign' adds (1) or removes (-1).
+*/
+static void estimate(lmp_Context *ctx, size_t size, size_t luatype, int sign) {
+  double p = 1 - exp(-(double) size / ctx->sampleinterval);
+  double bytes = size / p;
+  ctx->est_live += sign * bytes;
+  ctx->est_var += sign * (bytes * bytes * (1 - p));
+  ctx->est_type[typeindex(luatype)] += sign * bytes;
+}
+
+/* counts 'size' bytes in the sampler and keeps the block if sampled */
+static void sample(lmp_Context *ctx, void *ptr, size_t size, size_t luatype) {
+  lmp_Block *block;
+  size_t i;
+  ctx->countdown -= size;
+  if (ctx->countdown > 0)
+    return;
+  ctx->countdown = 0;
+  nextsample(ctx);
+
+  block = st_newblock(ctx->hash);
+  st_initblock(ctx->hash, block, ptr, size, luatype);
+  st_insertblock(ctx->hash, block);
+  i = filterindex(ptr);
+  if (ctx->filter[i] < FILTER_MAX)
+    ctx->filter[i]++;
+  estimate(ctx, size, luatype, 1);
+}
+
+/*
+** forgets a sampled block and returns its type. returns LUA_TNONE if the
+** block was not sampled, without any table lookup when the filter says so.
+*/
+static int unsample(lmp_Context *ctx, void *ptr) {
+  lmp_Block *block;
+  int luatype;
+  size_t i = filterindex(ptr);
+  if (ctx->filter[i] == 0)
+    return LUA_TNONE;
+  block = st_removeblock(ctx->hash, ptr);
+  if (block == NULL)
+    return LUA_TNONE;
+  if (ctx->filter[i] < FILTER_MAX)
+    ctx->filter[i]--;
+  luatype = st_getluatype(block);
+  estimate(ctx, st_getsize(block), luatype, -1);
+  st_freeblock(ctx->hash, block);
+  return luatype;
+}
+
+/*
+** sample mode: exact counters (as in counters mode) plus the blocks of the
+** sampled allocations, which give unbiased estimations of the live memory.
+** A realloc is handled as a free of the old block followed by a new
+** allocation of nsize bytes; the type of a realloc'ed block is known only
+** if the old block was sampled.
+*/
+static void *lmp_samplealloc(lmp_Context *ctx, void *ptr, size_t osize,
+                                                          size_t nsize) {
+  if (nsize == 0) {
+    if (ptr != NULL) {
+      updatecounters(ctx, LMP_FREE, osize, 0, 0);
+      unsample(ctx, ptr);
+    }
+    return ctx->f(ctx->ud, ptr, osize, 0);
+  } else if (ptr == NULL) {
+    ptr = ctx->f(ctx->ud, NULL, osize, nsize);
+    if (ptr != NULL) {
+      /* osize is the lua_type */
+      updatecounters(ctx, LMP_MALLOC, 0, nsize, osize);
+      if ((uintptr_t) ptr > ctx->Maddress)
+        ctx->Maddress = (uintptr_t) ptr;
+      sample(ctx, ptr, nsize, osize);
+    }
+    return ptr;
+  } else {
+    void *p = ctx->f(ctx->ud, ptr, osize, nsize);
+    if (p != NULL) {
+      int luatype;
+      updatecounters(ctx, LMP_REALLOC, osize, nsize, 0);
+      luatype = unsample(ctx, ptr);
+      sample(ctx, p, nsize, luatype);
+    }
+    return p;
+  }
+}
+
+/*
+** records an operation of lmp_alloc in the trace. Failed mallocs and
+** reallocs changed nothing and are not recorded. Sites are defined in the
+** trace before their first malloc (their parents have smaller ids).
+*/
+static void traceop (lmp_Context *ctx, void *ptr, size_t osize,
+                                       size_t nsize, void *p) {
+  if (nsize == 0) {
+    if (ptr != NULL)
+      tr_free(ctx->trace, ptr, osize);
+  } else if (p == NULL) {
+    return;
+  } else if (ptr == NULL) {  /* osize is the lua_type */
+    unsigned int site = LMP_NOSITE;
+    if (ctx->sites != NULL) {
+      site = ctx->lastsite;
+      while (tr_nsites(ctx->trace) <= site) {
+        lmp_Site *s = si_get(ctx->sites, tr_nsites(ctx->trace));
+        tr_site(ctx->trace, s->parent, s->where);
+      }
+    }
+    tr_malloc(ctx->trace, p, nsize, typeindex(osize), site);
+  } else {
+    tr_realloc(ctx->trace, ptr, p, osize, nsize);
+  }
+}
+
+/* adds 'n' blocks and 'size' bytes to the live counters of a type */
+static void updatelive (lmp_TypeCounters *tc, long n, long size) {
+  tc->live = tc->live + n;
+  tc->livesize = tc->livesize + size;
+  if (tc->live > tc->maxlive)
+    tc->maxlive = tc->live;
+  if (tc->livesize > tc->maxlivesize)
+    tc->maxlivesize = tc->livesize;
+}
+
+/*
+** returns the size class of 'size': sizes below 2^SIZE_SUBBITS have their
+** own class, the others are split by their highest bit and the next
+** SIZE_SUBBITS bits.
+*/
+static int sizeclass (size_t size) {
+  int e, c;
+  if (size < (1 << SIZE_SUBBITS))
+    return (int) size;
+#if defined(__GNUC__)
+  e = (int) (sizeof(long) * 8 - 1) - __builtin_clzl((unsigned long) size);
+#else
+  for (e = SIZE_SUBBITS; (size >> e) > 1; e++) ;
+#endif
+  c = ((e - SIZE_SUBBITS + 1) << SIZE_SUBBITS) +
+      (int) ((size >> (e - SIZE_SUBBITS)) & ((1 << SIZE_SUBBITS) - 1));
+  return c < SIZE_NCLASSES ? c : SIZE_NCLASSES - 1;
+}
+
+/* returns the smallest size of a size class */
+static size_t classsize (int c) {
+  int e = (c >> SIZE_SUBBITS) + SIZE_SUBBITS - 1;
+  if (c < (1 << SIZE_SUBBITS))
+    return (size_t) c;
+  return ((size_t) (c & ((1 << SIZE_SUBBITS) - 1)) + (1 << SIZE_SUBBITS))
+         << (e - SIZE_SUBBITS);
+}
+
+/*
+** lists a bucket of the peak composition that changed, the first time it
+** changes since the last peak. Each bucket is listed at most once per
+** epoch, so the list never has more entries than buckets.
+*/
+static void changed (lmp_Context *ctx, unsigned int bucket,
+                                       unsigned long *stamp) {
+  if (*stamp == ctx->peakepoch)
+    return;
+  *stamp = ctx->peakepoch;
+  if (ctx->nchanged == ctx->sizechanged) {
+    size_t size = ctx->sizechanged == 0 ? 256 : ctx->sizechanged * 2;
+    unsigned int *v = (unsigned int *) st_rawalloc(size *
+                                                   sizeof(unsigned int));
+    if (ctx->changed != NULL) {
+      memcpy(v, ctx->changed, ctx->nchanged * sizeof(unsigned int));
+      st_rawfree(ctx->changed, ctx->sizechanged * sizeof(unsigned int));
+    }
+    ctx->changed = v;
+    ctx->sizechanged = size;
+  }
+  ctx->changed[ctx->nchanged++] = bucket;
+}
+
+/* adds 'n' blocks of 'size' bytes to the live counters of a size class */
+static void updateclass (lmp_Context *ctx, size_t size, long n) {
+  int c = sizeclass(size);
+  ctx->liveclasses[c].live += n;
+  ctx->liveclasses[c].livesize += n * (long) size;
+  changed(ctx, PEAK_CLASS(c), &ctx->stamps[PEAK_CLASS(c)]);
+}
+
+/*
+** a new peak (or the peak again): copies the live counters of the buckets
+** that changed since the last one into the peak composition. The cost is
+** proportional to the operations since the last peak, never to the number
+** of blocks.
+*/
+static void commitpeak (lmp_Context *ctx) {
+  size_t i;
+  for (i = 0; i < ctx->nchanged; i++) {
+    unsigned int b = ctx->changed[i];
+    if (b < PEAK_CLASS(0)) {
+      ctx->peaktypes[b].live = ctx->types[b].live;
+      ctx->peaktypes[b].livesize = ctx->types[b].livesize;
+    } else if (b < PEAK_SITE(0)) {
+      int c = (int) (b - PEAK_CLASS(0));
+      ctx->peakclasses[c] = ctx->liveclasses[c];
+    } else {
+      lmp_Site *site = si_get(ctx->sites, b - PEAK_SITE(0));
+      site->peaklive = site->live;
+      site->peaklivesize = site->livesize;
+    }
+  }
+  ctx->nchanged = 0;
+  ctx->peakepoch++;
+  ctx->peaktotal.live = ctx->nallocs - ctx->nfrees;
+  ctx->peaktotal.livesize = ctx->memoryuse;
+  ctx->peaknops = ctx->nallocs + ctx->nreallocs + ctx->nfrees;
+}
+
+/*
+** check alloctype and update counters accordingly. 'osize' is 0 for a
+** malloc and 'nsize' is 0 for a free. 'luatype' is the type of the block,
+** which is known on free and realloc only in LMP_MODE_FULL (otherwise they
+** are counted as other).
+*/
+static void updatecounters (lmp_Context *ctx, int alloctype, size_t osize,
+                                           size_t nsize, size_t luatype) {
+  int t = typeindex(luatype);
+  lmp_TypeCounters *tc = &ctx->types[t];
+  int live = (ctx->mode == LMP_MODE_FULL);
+  if (ctx->peak)
+    changed(ctx, PEAK_TYPE(t), &ctx->stamps[PEAK_TYPE(t)]);
   if (alloctype == LMP_FREE) {
-    nfrees = nfrees + 1;
-    free_size = free_size + size;
-    memoryuse = memoryuse - size;
+    ctx->nfrees = ctx->nfrees + 1;
+    ctx->free_size = ctx->free_size + osize;
+    ctx->memoryuse = ctx->memoryuse - osize;
+    ctx->hist[HIST_FREE][t][sizeclass(osize)]++;
+    if (live)
+      updatelive(tc, -1, -(long) osize);
+    if (ctx->peak)
+      updateclass(ctx, osize, -1);
   } else if (alloctype == LMP_REALLOC) {
-    nreallocs = nreallocs + 1;
-    realloc_size = realloc_size + size;
-    memoryuse = memoryuse + size;
-    if (memoryuse > maxmemoryuse) {
-      maxmemoryuse = memoryuse;
+    long size = (long) nsize - (long) osize;
+    ctx->nreallocs = ctx->nreallocs + 1;
+    ctx->realloc_size = ctx->realloc_size + size;
+    if (size > 0)
+      ctx->grow_size = ctx->grow_size + size;
+    ctx->memoryuse = ctx->memoryuse + size;
+    if (ctx->memoryuse > ctx->maxmemoryuse) {
+      ctx->maxmemoryuse = ctx->memoryuse;
+    }
+    ctx->hist[size >= 0 ? HIST_GROW : HIST_SHRINK][t][sizeclass(nsize)]++;
+    if (live)
+      updatelive(tc, 0, size);
+    if (ctx->peak) {
+      updateclass(ctx, osize, -1);
+      updateclass(ctx, nsize, 1);
     }
   } else if (alloctype == LMP_MALLOC) {
-    nallocs = nallocs + 1;
-    alloc_size = alloc_size + size;
-    memoryuse = memoryuse + size;
-    if (memoryuse > maxmemoryuse) {
-      maxmemoryuse = memoryuse;
-    }
-    switch(luatype) {
-      case LUA_TSTRING:
-        ac_string++;
-        break;
-      case LUA_TFUNCTION:
-        ac_function++;
-        break;
-      case LUA_TUSERDATA:
-        ac_userdata++;
-        break;
-      case LUA_TTHREAD:
-        ac_thread++;
-        break;
-      case LUA_TTABLE:
-        ac_table++;
-        break;
-      default:
-        ac_other++;
+    ctx->nallocs = ctx->nallocs + 1;
+    ctx->alloc_size = ctx->alloc_size + nsize;
+    ctx->memoryuse = ctx->memoryuse + nsize;
+    if (ctx->memoryuse > ctx->maxmemoryuse) {
+      ctx->maxmemoryuse = ctx->memoryuse;
     }
+    ctx->hist[HIST_MALLOC][t][sizeclass(nsize)]++;
+    tc->nallocs++;
+    if (live)
+      updatelive(tc, 1, (long) nsize);
+    if (ctx->peak)
+      updateclass(ctx, nsize, 1);
+  }
+}
+
+/* writes the counters part of the report */
+static void printcounters(lmp_Context *ctx) {
+printf("Number of Mallocs=%ld\tTotal Malloc Size=%ld\n", ctx->nallocs, ctx->alloc_size);
+printf("Number of Reallocs=%ld\tTotal Realloc Size=%ld\n", ctx->nreallocs, ctx->realloc_size);
+printf("Number of Frees=%ld\tTotal Free Size=%ld\n", ctx->nfrees, ctx->free_size);
+printf("\nNumber of Allocs of Each Type:\n");
+printf("  String=%ld | Function=%ld | Userdata=%ld | Thread=%ld | Table=%ld | Other=%ld\n", ctx->types[0].nallocs, ctx->types[1].nallocs, ctx->types[2].nallocs, ctx->types[3].nallocs, ctx->types[4].nallocs, ctx->types[5].nallocs);
+}
+
+/* adds a freed block that lived 'age' mallocs to the lifetime histogram */
+static void updatelifetime (lmp_Context *ctx, size_t luatype,
+                                              unsigned long age) {
+  int c = 0;
+  for (; age > 0 && c < LIFE_NCLASSES - 1; age >>= 1)
+    c++;
+  ctx->life[typeindex(luatype)][c]++;
+}
+
+/*
+** adds 'n' blocks and 'size' bytes to the live counters of the site of a
+** block. Growth (malloc or realloc) is also added to the allocated bytes.
+*/
+static void updatesite (lmp_Context *ctx, lmp_Block *block, long n,
+                                                            long size) {
+  lmp_Site *site = si_get(ctx->sites, st_getsite(block));
+  site->live += n;
+  site->livesize += size;
+  if (size > 0)
+    site->allocsize += size;
+  if (ctx->peak)
+    changed(ctx, PEAK_SITE(st_getsite(block)), &site->peakstamp);
+}
+
+/*
+** counts a realloc of a block that kept its address or, if 'moved', that
+** moved it, copying (we estimate) the bytes that fit in both sizes. 'osize'
+** is the old size of the block and 'nsize' the new one.
+*/
+static void updaterealloc (lmp_Context *ctx, lmp_Block *block, int moved,
+                                             size_t osize, size_t nsize) {
+  int grow = (nsize >= osize);
+  long copy = 0;
+  if (moved) {
+    copy = (long) (grow ? osize : nsize);
+    ctx->copysize += copy;
+    if (grow)
+      ctx->movegrows++;
+    else
+      ctx->moveshrinks++;
+  } else if (grow) {
+    ctx->ingrows++;
+  } else {
+    ctx->inshrinks++;
+  }
+  st_setresizes(block, st_getresizes(block) + 1);
+  if (ctx->sites != NULL) {
+    lmp_Site *site = si_get(ctx->sites, st_getsite(block));
+    site->grows += grow;
+    site->copysize += copy;
+  }
+}
+
+/* adds a block to the class of its reallocs ('ud' is an lmp_Resizes) */
+static void countresizes (lmp_Block *block, void *ud) {
+  lmp_Resizes *r = (lmp_Resizes *) ud;
+  unsigned int n = st_getresizes(block);
+  int c = 0;
+  for (; n > 0; n >>= 1)
+    c++;
+  r->blocks[c]++;
+  r->size[c] += (long) st_getsize(block);
+}
+
+/* orders sites by allocated bytes (largest first) */
+static int sitecmp (const void *a, const void *b) {
+  long sa = (*(lmp_Site *const *) a)->allocsize;
+  long sb = (*(lmp_Site *const *) b)->allocsize;
+  return (sa < sb) - (sa > sb);
+}
+
+/*
+** returns the sites with mallocs ('*n' entries), largest first, in raw
+** memory of si_count entries.
+*/
+static lmp_Site **sortsites (lmp_Context *ctx, unsigned int *n) {
+  unsigned int i, nsites = si_count(ctx->sites);
+  lmp_Site **v = (lmp_Site **) st_rawalloc(nsites * sizeof(lmp_Site *));
+  *n = 0;
+  for (i = 0; i < nsites; i++) {
+    if (si_get(ctx->sites, i)->nallocs > 0)
+      v[(*n)++] = si_get(ctx->sites, i);
+  }
+  qsort(v, *n, sizeof(lmp_Site *), sitecmp);
+  return v;
+}
+
+/* writes the SITE_TOP sites that allocated more bytes */
+static void printsites(lmp_Context *ctx) {
+  unsigned int i, n, nsites = si_count(ctx->sites);
+  lmp_Site **v = sortsites(ctx, &n);
+printf("\nAllocation Sites (%u sites, top %d by allocated bytes):\n", n, SITE_TOP);
+  for (i = 0; i < n && i < SITE_TOP; i++) {
+printf("  bytes=%ld allocs=%ld live=%ld livebytes=%ld  ", v[i]->allocsize, v[i]->nallocs, v[i]->live, v[i]->livesize);
+    si_print(ctx->sites, (unsigned int) (v[i] - si_get(ctx->sites, 0)));
+printf("\n");
+  }
+  st_rawfree(v, nsites * sizeof(lmp_Site *));
+}
+
+/* blocks alive of one (type, site) group */
+typedef struct lmp_leak {
+  long nblocks;
+  long size;
+  unsigned int site;
+  int type;  /* typeindex */
+} lmp_Leak;
+
+/* adds a block to its group; groups are indexed by site and type */
+static void countleak (lmp_Block *block, void *ud) {
+  lmp_Leak *g = (lmp_Leak *) ud;
+  g += (size_t) st_getsite(block) * LMP_NTYPES +
+                typeindex(st_getluatype(block));
+  g->nblocks++;
+  g->size += st_getsize(block);
+}
+
+/* orders groups by bytes (largest first) */
+static int leakcmp (const void *a, const void *b) {
+  long sa = (*(lmp_Leak *const *) a)->size;
+  long sb = (*(lmp_Leak *const *) b)->size;
+  return (sa < sb) - (sa > sb);
+}
+
+/*
+** groups the blocks still alive by type and allocation site (only type if
+** there are no sites). Returns the groups ('*ngroups' entries) and sets 'v'
+** with the non empty ones ('*n' entries), largest first. Both arrays are
+** raw memory of '*ngroups' entries.
+*/
+static lmp_Leak *leakgroups (lmp_Context *ctx, size_t *ngroups,
+                                           lmp_Leak ***v, size_t *n) {
+  size_t i;
+  lmp_Leak *g;
+  *ngroups = LMP_NTYPES;
+  if (ctx->sites != NULL)
+    *ngroups *= si_count(ctx->sites);
+  g = (lmp_Leak *) st_rawalloc(*ngroups * sizeof(lmp_Leak));
+  *v = (lmp_Leak **) st_rawalloc(*ngroups * sizeof(lmp_Leak *));
+  st_traverse(ctx->hash, countleak, g);
+  *n = 0;
+  for (i = 0; i < *ngroups; i++) {
+    if (g[i].nblocks > 0) {
+      g[i].site = (unsigned int) (i / LMP_NTYPES);
+      g[i].type = (int) (i % LMP_NTYPES);
+      (*v)[(*n)++] = &g[i];
+    }
+  }
+  qsort(*v, *n, sizeof(lmp_Leak *), leakcmp);
+  return g;
+}
+
+/*
+** writes the blocks allocated after start and still alive, grouped by type
+** and allocation site, largest first.
+*/
+static void printleaks(lmp_Context *ctx) {
+  size_t i, n, ngroups;
+  long nblocks = 0, size = 0;
+  lmp_Leak **v;
+  lmp_Leak *g = leakgroups(ctx, &ngroups, &v, &n);
+  for (i = 0; i < n; i++) {
+    nblocks += v[i]->nblocks;
+    size += v[i]->size;
+  }
+printf("\nBlocks Still Alive=%ld\tTotal Size=%ld (%lu groups, top %d by bytes):\n", nblocks, size, (unsigned long) n, LEAK_TOP);
+  for (i = 0; i < n && i < LEAK_TOP; i++) {
+printf("  bytes=%ld blocks=%ld  %s", v[i]->size, v[i]->nblocks, typenames[v[i]->type]);
+    if (ctx->sites != NULL) {
+printf("  ");
+      si_print(ctx->sites, v[i]->site);
+    }
+printf("\n");
+  }
+  st_rawfree(g, ngroups * sizeof(lmp_Leak));
+  st_rawfree(v, ngroups * sizeof(lmp_Leak *));
+}
+
+/*
+** writes in 'buf' the range of a log2 class ("16-31"): 0, then
+** [2^(c-1), 2^c), the last of 'nclasses' takes the rest (lifetimes and
+** reallocs per block)
+*/
+static void log2name (int c, int nclasses, char *buf) {
+  if (c <= 1)
+    sprintf(buf, "%d", c);
+  else if (c == nclasses - 1)
+    sprintf(buf, "%lu+", 1UL << (c - 1));
+  else
+    sprintf(buf, "%lu-%lu", 1UL << (c - 1), (1UL << c) - 1);
+}
+
+/* writes the lifetime histogram of each type, one line per type */
+static void printlifetimes(lmp_Context *ctx) {
+  char range[48];
+  int c, i;
+printf("\nLifetime of Freed Blocks of Each Type (in mallocs, young < %d):\n", 1 << LIFE_YOUNG);
+  for (i = 0; i < LMP_NTYPES; i++) {
+    long young = 0, old = 0;
+    for (c = 0; c < LIFE_NCLASSES; c++) {
+      if (c <= LIFE_YOUNG)
+        young += ctx->life[i][c];
+      else
+        old += ctx->life[i][c];
+    }
+printf("  %s: young=%ld old=%ld alive=%ld |", typenames[i], young, old, ctx->types[i].live);
+    for (c = 0; c < LIFE_NCLASSES; c++) {
+      if (ctx->life[i][c] == 0)
+        continue;
+      log2name(c, LIFE_NCLASSES, range);
+printf(" %s:%ld", range, ctx->life[i][c]);
+    }
+printf("\n");
+  }
+}
+
+/* writes in 'buf' the range of bytes of a size class ("64-79") */
+static void classname (int c, char *buf) {
+  if (c == SIZE_NCLASSES - 1)
+    sprintf(buf, "%lu+", (unsigned long) classsize(c));
+  else if (c < (1 << SIZE_SUBBITS))
+    sprintf(buf, "%lu", (unsigned long) classsize(c));
+  else
+    sprintf(buf, "%lu-%lu", (unsigned long) classsize(c),
+                            (unsigned long) classsize(c + 1) - 1);
+}
+
+/* writes the size class histogram of one operation, one line per class */
+static void printhistogram(long h[LMP_NTYPES][SIZE_NCLASSES],
+                                             const char *name) {
+  char range[48];
+  int c, i;
+printf("\n%s by Size Class (bytes: total | string function userdata thread table other):\n", name);
+  for (c = 0; c < SIZE_NCLASSES; c++) {
+    long n = 0;
+    for (i = 0; i < LMP_NTYPES; i++)
+      n += h[i][c];
+    if (n == 0)
+      continue;
+    classname(c, range);
+printf("  %s: %ld | %ld %ld %ld %ld %ld %ld\n", range, n, h[0][c], h[1][c], h[2][c], h[3][c], h[4][c], h[5][c]);
+  }
+}
+
+/* writes the detailed part of the report (option detail) */
+static void printdetail(lmp_Context *ctx) {
+  lmp_TypeCounters *t = ctx->types;
+  if (ctx->mode == LMP_MODE_FULL) {
+printf("\nLive Blocks of Each Type (now/maximum):\n");
+printf("  String=%ld/%ld | Function=%ld/%ld | Userdata=%ld/%ld | Thread=%ld/%ld | Table=%ld/%ld | Other=%ld/%ld\n", t[0].live, t[0].maxlive, t[1].live, t[1].maxlive, t[2].live, t[2].maxlive, t[3].live, t[3].maxlive, t[4].live, t[4].maxlive, t[5].live, t[5].maxlive);
+printf("Live Bytes of Each Type (now/maximum):\n");
+printf("  String=%ld/%ld | Function=%ld/%ld | Userdata=%ld/%ld | Thread=%ld/%ld | Table=%ld/%ld | Other=%ld/%ld\n", t[0].livesize, t[0].maxlivesize, t[1].livesize, t[1].maxlivesize, t[2].livesize, t[2].maxlivesize, t[3].livesize, t[3].maxlivesize, t[4].livesize, t[4].maxlivesize, t[5].livesize, t[5].maxlivesize);
+    printlifetimes(ctx);
+  }
+  printhistogram(ctx->hist[HIST_MALLOC], "Mallocs");
+  printhistogram(ctx->hist[HIST_GROW], "Reallocs Growing");
+  printhistogram(ctx->hist[HIST_SHRINK], "Reallocs Shrinking");
+  printhistogram(ctx->hist[HIST_FREE], "Frees");
+}
+
+/*
+** gets the timeline points and marks for the report (raw memory, see
+** freetimeline). Called by lmp_stop, without the lock.
+*/
+static int gettimeline (lmp_Context *ctx, lmp_TimePoint **points,
+                        lmp_TimeMark **marks, int *nmarks, long *interval,
+                                                           int *clock) {
+  *points = (lmp_TimePoint *) st_rawalloc((LMP_TIMELINE_SIZE + 1) *
+                                          sizeof(lmp_TimePoint));
+  *marks = (lmp_TimeMark *) st_rawalloc(LMP_TIMELINE_MARKS *
+                                        sizeof(lmp_TimeMark));
+  *nmarks = tl_marks(ctx->timeline, *marks);
+  *interval = tl_interval(ctx->timeline, clock);
+  return tl_points(ctx->timeline, *points,
+                   ctx->nallocs + ctx->nreallocs + ctx->nfrees,
+                   ctx->memoryuse, ctx->types);
+}
+
+static void freetimeline (lmp_TimePoint *points, lmp_TimeMark *marks) {
+  st_rawfree(points, (LMP_TIMELINE_SIZE + 1) * sizeof(lmp_TimePoint));
+  st_rawfree(marks, LMP_TIMELINE_MARKS * sizeof(lmp_TimeMark));
+}
+
+/* writes the timeline, with each mark before the first point after it */
+static void printtimeline(lmp_Context *ctx) {
+  lmp_TimePoint *p;
+  lmp_TimeMark *m;
+  long interval;
+  int i, j = 0, n, nmarks, clock;
+  n = gettimeline(ctx, &p, &m, &nmarks, &interval, &clock);
+printf("\nMemory Timeline (%d points, one every %ld %s):\n", n, interval, clock ? "ms" : "operations");
+printf("  operations seconds: bytes peak | string function userdata thread table other\n");
+  for (i = 0; i < n; i++) {
+    for (; j < nmarks && m[j].nops <= p[i].nops; j++)
+printf("  %ld %.3f: mark \"%s\" bytes=%ld\n", m[j].nops, m[j].time, m[j].label, m[j].memoryuse);
+printf("  %ld %.3f: %ld %ld | %ld %ld %ld %ld %ld %ld\n", p[i].nops, p[i].time, p[i].memoryuse, p[i].peak, p[i].types[0], p[i].types[1], p[i].types[2], p[i].types[3], p[i].types[4], p[i].types[5]);
+  }
+  freetimeline(p, m);
+}
+
+/* writes the statistics of the last garbage collection cycles */
+static void printgc(lmp_Context *ctx) {
+  lmp_GCCycle v[LMP_GC_CYCLES], t;
+  int i, n = gc_cycles(ctx->gc, v);
+  gc_total(ctx->gc, &t);
+printf("\nGarbage Collection Cycles=%ld (the last %d listed)\n", t.number, n);
+printf("  cycle seconds: allocated reclaimed | survivors (blocks bytes) | peak growth pause\n");
+  for (i = 0; i < n; i++)
+printf("  %ld %.3f: %ld %ld | %ld %ld | %ld %ld %.0f%%\n", v[i].number, v[i].time, v[i].allocated, v[i].reclaimed, v[i].survivors, v[i].survivorsize, v[i].peak, v[i].growth, v[i].pause);
+  if (t.number > 0)
+printf("Mean per Cycle: seconds=%.3f allocated=%.0f reclaimed=%.0f growth=%.0f\tMaximum Pause=%.0f%%\n", t.time / t.number, (double) t.allocated / t.number, (double) t.reclaimed / t.number, (double) t.growth / t.number, t.pause);
+}
+
+/* orders sites by bytes alive at the peak (largest first) */
+static int peaksitecmp (const void *a, const void *b) {
+  long sa = (*(lmp_Site *const *) a)->peaklivesize;
+  long sb = (*(lmp_Site *const *) b)->peaklivesize;
+  return (sa < sb) - (sa > sb);
+}
+
+/*
+** returns the sites with blocks alive at the peak, largest first, in an
+** array of si_count entries (raw memory); 'n' gets their number
+*/
+static lmp_Site **sortpeaksites (lmp_Context *ctx, unsigned int *n) {
+  unsigned int i, nsites = si_count(ctx->sites);
+  lmp_Site **v = (lmp_Site **) st_rawalloc(nsites * sizeof(lmp_Site *));
+  *n = 0;
+  for (i = 0; i < nsites; i++) {
+    lmp_Site *site = si_get(ctx->sites, i);
+    if (site->peaklive > 0)
+      v[(*n)++] = site;
+  }
+  qsort(v, *n, sizeof(lmp_Site *), peaksitecmp);
+  return v;
+}
+
+/* orders sites by growing reallocs (most first) */
+static int growsitecmp (const void *a, const void *b) {
+  long sa = (*(lmp_Site *const *) a)->grows;
+  long sb = (*(lmp_Site *const *) b)->grows;
+  return (sa < sb) - (sa > sb);
+}
+
+/*
+** returns the sites whose blocks grew, most growing reallocs first, in an
+** array of si_count entries (raw memory); 'n' gets their number
+*/
+static lmp_Site **sortgrowsites (lmp_Context *ctx, unsigned int *n) {
+  unsigned int i, nsites = si_count(ctx->sites);
+  lmp_Site **v = (lmp_Site **) st_rawalloc(nsites * sizeof(lmp_Site *));
+  *n = 0;
+  for (i = 0; i < nsites; i++) {
+    lmp_Site *site = si_get(ctx->sites, i);
+    if (site->grows > 0)
+      v[(*n)++] = site;
+  }
+  qsort(v, *n, sizeof(lmp_Site *), growsitecmp);
+  return v;
+}
+
+/*
+** writes the reallocs in place and moving, the blocks by number of reallocs
+** (freed ones, then the ones still alive) and the sites whose blocks grew
+** the most (repeated growth: candidates to be allocated with their final
+** size)
+*/
+static void printreallocs(lmp_Context *ctx) {
+  lmp_Resizes alive;
+  lmp_Resizes *freed = &ctx->resized;
+  char name[SITENAME_SIZE];
+  unsigned int i, n;
+  int c;
+  memset(&alive, 0, sizeof(alive));
+  st_traverse(ctx->hash, countresizes, &alive);
+printf("\nReallocs In Place: Grow=%ld Shrink=%ld\tMoved: Grow=%ld Shrink=%ld\tEstimated Bytes Copied=%ld\n", ctx->ingrows, ctx->inshrinks, ctx->movegrows, ctx->moveshrinks, ctx->copysize);
+printf("Reallocs per Block (reallocs: freed blocks, mean size | alive blocks, mean size):\n");
+  for (c = 0; c < RESIZE_NCLASSES; c++) {
+    if (freed->blocks[c] == 0 && alive.blocks[c] == 0)
+      continue;
+    log2name(c, RESIZE_NCLASSES, name);
+printf("  %s: %ld %.0f | %ld %.0f\n", name, freed->blocks[c], freed->blocks[c] > 0 ? (double) freed->size[c] / freed->blocks[c] : 0.0, alive.blocks[c], alive.blocks[c] > 0 ? (double) alive.size[c] / alive.blocks[c] : 0.0);
+  }
+  if (ctx->sites != NULL) {
+    lmp_Site **v = sortgrowsites(ctx, &n);
+printf("Sites of Growing Reallocs (%u sites, top %d by grows):\n", n, SITE_TOP);
+    for (i = 0; i < n && i < SITE_TOP; i++) {
+      si_tostring(ctx->sites, (unsigned int) (v[i] - si_get(ctx->sites, 0)),
+                  name, sizeof(name));
+printf("  grows=%ld copied=%ld allocs=%ld  %s\n", v[i]->grows, v[i]->copysize, v[i]->nallocs, name);
+    }
+    st_rawfree(v, si_count(ctx->sites) * sizeof(lmp_Site *));
+  }
+}
+
+/* writes the composition of the live memory at the peak */
+static void printpeak(lmp_Context *ctx) {
+  lmp_Live *t = ctx->peaktypes;
+  char name[SITENAME_SIZE];
+  unsigned int i, n;
+  int c;
+printf("\nLive Memory at the Peak (operation %ld)=%ld bytes in %ld blocks\n", ctx->peaknops, ctx->peaktotal.livesize, ctx->peaktotal.live);
+printf("  String=%ld | Function=%ld | Userdata=%ld | Thread=%ld | Table=%ld | Other=%ld\n", t[0].livesize, t[1].livesize, t[2].livesize, t[3].livesize, t[4].livesize, t[5].livesize);
+printf("Size Classes at the Peak (bytes: blocks bytes):\n");
+  for (c = 0; c < SIZE_NCLASSES; c++) {
+    if (ctx->peakclasses[c].live == 0)
+      continue;
+    classname(c, name);
+printf("  %s: %ld %ld\n", name, ctx->peakclasses[c].live, ctx->peakclasses[c].livesize);
+  }
+  if (ctx->sites != NULL) {
+    lmp_Site **v = sortpeaksites(ctx, &n);
+printf("Sites at the Peak (%u sites, top %d by bytes):\n", n, SITE_TOP);
+    for (i = 0; i < n && i < SITE_TOP; i++) {
+      si_tostring(ctx->sites, (unsigned int) (v[i] - si_get(ctx->sites, 0)),
+                  name, sizeof(name));
+printf("  bytes=%ld blocks=%ld  %s\n", v[i]->peaklivesize, v[i]->peaklive, name);
+    }
+    st_rawfree(v, si_count(ctx->sites) * sizeof(lmp_Site *));
   }
 }
 
 /* 
 ** writes the report in the standard output. If not usegraphics, calculates
 ** program memory usage and sugest memory consumption parameter for future
-** execution.
+** execution (not when replaying a trace, which has no lua_State).
  */
-static void generatereport() {
-  float mem = ((float) (Maddress - Laddress) / 1000000) + 0.1;
+static void generatereport(lmp_Context *ctx) {
+  float mem = ((float) (ctx->Maddress - ctx->Laddress) / 1000000) + 0.1;
 
-  if (!usegraphics)
+  if (!ctx->usegraphics)
     mem = mem + 0.4;  /* empiric size of graphic mem usage */
 
 printf("===================================================================\n");
-printf("Number of Mallocs=%ld\tTotal Malloc Size=%ld\n", nallocs, alloc_size);
-printf("Number of Reallocs=%ld\tTotal Realloc Size=%ld\n", nreallocs, realloc_size);
-printf("Number of Frees=%ld\tTotal Free Size=%ld\n", nfrees, free_size);
-printf("\nNumber of Allocs of Each Type:\n");
-printf("  String=%d | Function=%d | Userdata=%d | Thread=%d | Table=%d | Other=%d\n", ac_string, ac_function, ac_userdata, ac_thread, ac_table, ac_other);
-printf("\nMaximum Memory Used=%ld bytes\n", maxmemoryuse);
+  printcounters(ctx);
+printf("\nMaximum Memory Used=%ld bytes\n", ctx->maxmemoryuse);
+  if (ctx->detail)
+    printdetail(ctx);
+
+  if (ctx->hookstale)
+printf("\nThe hook of the profiler was replaced by another one before malloc %ld:\nthe sites of the following mallocs were found by walking the stack of the main thread\n", ctx->hookstale);
+  if (ctx->sites != NULL)
+    printsites(ctx);
+  if (ctx->leaks)
+    printleaks(ctx);
+  if (ctx->peak)
+    printpeak(ctx);
+  if (ctx->timeline != NULL)
+    printtimeline(ctx);
+  if (ctx->gc != NULL)
+    printgc(ctx);
+  if (ctx->reallocs)
+    printreallocs(ctx);
 
-  if (!usegraphics && nallocs > 0) {
+  if (ctx->mode == LMP_MODE_SAMPLE) {
+printf("\nEstimated Live Memory=%.0f bytes (standard error=%.0f bytes)\n", ctx->est_live, sqrt(ctx->est_var));
+printf("  String=%.0f | Function=%.0f | Userdata=%.0f | Thread=%.0f | Table=%.0f | Other=%.0f\n", ctx->est_type[0], ctx->est_type[1], ctx->est_type[2], ctx->est_type[3], ctx->est_type[4], ctx->est_type[5]);
+printf("  (one sample every %ld bytes on average)\n", ctx->sampleinterval);
+  }
+
+  if (ctx->trace != NULL) {
+    long nevents, dropped, sampled;
+    tr_counts(ctx->trace, &nevents, &dropped, &sampled);
+printf("\nTrace Events=%ld\tDropped=%ld\tSampled Out=%ld\n", nevents, dropped, sampled);
+  }
+
+  if (!ctx->usegraphics && ctx->nallocs > 0 && ctx->L != NULL) {
 printf("\nWe suggest you run the application again using %.1f as parameter\n", mem); 
   }
 printf("===================================================================\n");
 }
 
+
+/* writes the histograms of all operations in the section "sizes" */
+static void writehistograms (lmp_Context *ctx, lmp_Output *o) {
+  static const char *const ops[HIST_NOPS] = {
+    "malloc", "grow", "shrink", "free"
+  };
+  char name[64];
+  int op, c, i;
+  ou_section(o, "sizes");
+  for (op = 0; op < HIST_NOPS; op++) {
+    for (c = 0; c < SIZE_NCLASSES; c++) {
+      long n = 0;
+      for (i = 0; i < LMP_NTYPES; i++)
+        n += ctx->hist[op][i][c];
+      if (n == 0)
+        continue;
+      strcpy(name, ops[op]);
+      strcat(name, " ");
+      classname(c, name + strlen(name));
+      ou_row(o, name);
+      ou_field(o, "total", n);
+      for (i = 0; i < LMP_NTYPES; i++)
+        ou_field(o, typenames[i], ctx->hist[op][i][c]);
+    }
+  }
+}
+
+/* writes the lifetime histograms in the section "lifetimes" */
+static void writelifetimes (lmp_Context *ctx, lmp_Output *o) {
+  char range[48];
+  int c, i;
+  ou_section(o, "lifetimes");
+  for (i = 0; i < LMP_NTYPES; i++) {
+    ou_row(o, typenames[i]);
+    for (c = 0; c < LIFE_NCLASSES; c++) {
+      if (ctx->life[i][c] == 0)
+        continue;
+      log2name(c, LIFE_NCLASSES, range);
+      ou_field(o, range, ctx->life[i][c]);
+    }
+  }
+}
+
+/* writes all sites with mallocs in the section "sites", largest first */
+static void writesites (lmp_Context *ctx, lmp_Output *o) {
+  char name[SITENAME_SIZE];
+  unsigned int i, n, nsites = si_count(ctx->sites);
+  lmp_Site **v = sortsites(ctx, &n);
+  ou_section(o, "sites");
+  for (i = 0; i < n; i++) {
+    si_tostring(ctx->sites, (unsigned int) (v[i] - si_get(ctx->sites, 0)),
+                name, sizeof(name));
+    ou_row(o, name);
+    ou_field(o, "bytes", v[i]->allocsize);
+    ou_field(o, "allocs", v[i]->nallocs);
+    ou_field(o, "live", v[i]->live);
+    ou_field(o, "livebytes", v[i]->livesize);
+  }
+  st_rawfree(v, nsites * sizeof(lmp_Site *));
+}
+
+/*
+** writes all (type, site) groups of blocks still alive in the section
+** "leaks"; rows are named by type and site, like the text report.
+*/
+static void writeleaks (lmp_Context *ctx, lmp_Output *o) {
+  char name[SITENAME_SIZE];
+  size_t i, n, ngroups;
+  lmp_Leak **v;
+  lmp_Leak *g = leakgroups(ctx, &ngroups, &v, &n);
+  ou_section(o, "leaks");
+  for (i = 0; i < n; i++) {
+    strcpy(name, typenames[v[i]->type]);
+    if (ctx->sites != NULL) {
+      strcat(name, "  ");
+      si_tostring(ctx->sites, v[i]->site, name + strlen(name),
+                  sizeof(name) - strlen(name));
+    }
+    ou_row(o, name);
+    ou_field(o, "bytes", v[i]->size);
+    ou_field(o, "blocks", v[i]->nblocks);
+  }
+  st_rawfree(g, ngroups * sizeof(lmp_Leak));
+  st_rawfree(v, ngroups * sizeof(lmp_Leak *));
+}
+
+/*
+** writes the composition at the peak: totals and types in the section
+** "peak", size classes in "peaksizes" and all sites in "peaksites"
+*/
+static void writepeak (lmp_Context *ctx, lmp_Output *o) {
+  char name[SITENAME_SIZE];
+  unsigned int i, n;
+  int c;
+  ou_section(o, "peak");
+  ou_row(o, "total");
+  ou_field(o, "operations", ctx->peaknops);
+  ou_field(o, "live", ctx->peaktotal.live);
+  ou_field(o, "livebytes", ctx->peaktotal.livesize);
+  for (c = 0; c < LMP_NTYPES; c++) {
+    ou_row(o, typenames[c]);
+    ou_field(o, "live", ctx->peaktypes[c].live);
+    ou_field(o, "livebytes", ctx->peaktypes[c].livesize);
+  }
+  ou_section(o, "peaksizes");
+  for (c = 0; c < SIZE_NCLASSES; c++) {
+    if (ctx->peakclasses[c].live == 0)
+      continue;
+    classname(c, name);
+    ou_row(o, name);
+    ou_field(o, "live", ctx->peakclasses[c].live);
+    ou_field(o, "livebytes", ctx->peakclasses[c].livesize);
+  }
+  if (ctx->sites != NULL) {
+    lmp_Site **v = sortpeaksites(ctx, &n);
+    ou_section(o, "peaksites");
+    for (i = 0; i < n; i++) {
+      si_tostring(ctx->sites, (unsigned int) (v[i] - si_get(ctx->sites, 0)),
+                  name, sizeof(name));
+      ou_row(o, name);
+      ou_field(o, "live", v[i]->peaklive);
+      ou_field(o, "livebytes", v[i]->peaklivesize);
+    }
+    st_rawfree(v, si_count(ctx->sites) * sizeof(lmp_Site *));
+  }
+}
+
+/*
+** writes the last garbage collection cycles in the section "gc" (rows
+** named by cycle number, after the row "total")
+*/
+static void writegc (lmp_Context *ctx, lmp_Output *o) {
+  lmp_GCCycle v[LMP_GC_CYCLES + 1];
+  char name[32];
+  int i, n = gc_cycles(ctx->gc, v + 1);
+  gc_total(ctx->gc, &v[0]);
+  ou_section(o, "gc");
+  for (i = 0; i <= n; i++) {
+    if (i == 0)
+      strcpy(name, "total");
+    else
+      sprintf(name, "%ld", v[i].number);
+    ou_row(o, name);
+    ou_field(o, "cycles", i == 0 ? v[0].number : 1);
+    ou_field(o, "seconds", v[i].time);
+    ou_field(o, "allocated", v[i].allocated);
+    ou_field(o, "reclaimed", v[i].reclaimed);
+    ou_field(o, "survivors", v[i].survivors);
+    ou_field(o, "survivorbytes", v[i].survivorsize);
+    ou_field(o, "peak", v[i].peak);
+    ou_field(o, "growth", v[i].growth);
+    ou_field(o, "pause", v[i].pause);
+  }
+}
+
+/*
+** writes the section "reallocs" (row "total"), the section "resizes"
+** (rows named by number of reallocs per block) and, with sites, the
+** section "growsites" with all sites whose blocks grew, most first
+*/
+static void writereallocs (lmp_Context *ctx, lmp_Output *o) {
+  lmp_Resizes alive;
+  char name[SITENAME_SIZE];
+  unsigned int i, n;
+  int c;
+  ou_section(o, "reallocs");
+  ou_row(o, "total");
+  ou_field(o, "ingrows", ctx->ingrows);
+  ou_field(o, "inshrinks", ctx->inshrinks);
+  ou_field(o, "movegrows", ctx->movegrows);
+  ou_field(o, "moveshrinks", ctx->moveshrinks);
+  ou_field(o, "copiedbytes", ctx->copysize);
+  memset(&alive, 0, sizeof(alive));
+  st_traverse(ctx->hash, countresizes, &alive);
+  ou_section(o, "resizes");
+  for (c = 0; c < RESIZE_NCLASSES; c++) {
+    if (ctx->resized.blocks[c] == 0 && alive.blocks[c] == 0)
+      continue;
+    log2name(c, RESIZE_NCLASSES, name);
+    ou_row(o, name);
+    ou_field(o, "freed", ctx->resized.blocks[c]);
+    ou_field(o, "freedbytes", ctx->resized.size[c]);
+    ou_field(o, "alive", alive.blocks[c]);
+    ou_field(o, "alivebytes", alive.size[c]);
+  }
+  if (ctx->sites != NULL) {
+    lmp_Site **v = sortgrowsites(ctx, &n);
+    ou_section(o, "growsites");
+    for (i = 0; i < n; i++) {
+      si_tostring(ctx->sites, (unsigned int) (v[i] - si_get(ctx->sites, 0)),
+                  name, sizeof(name));
+      ou_row(o, name);
+      ou_field(o, "grows", v[i]->grows);
+      ou_field(o, "copiedbytes", v[i]->copysize);
+      ou_field(o, "allocs", v[i]->nallocs);
+    }
+    st_rawfree(v, si_count(ctx->sites) * sizeof(lmp_Site *));
+  }
+}
+
+/* writes the sections "timeline" (rows named by index) and "marks" */
+static void writetimeline (lmp_Context *ctx, lmp_Output *o) {
+  lmp_TimePoint *p;
+  lmp_TimeMark *m;
+  char name[16];
+  long interval;
+  int i, j, n, nmarks, clock;
+  n = gettimeline(ctx, &p, &m, &nmarks, &interval, &clock);
+  ou_section(o, "timeline");
+  for (i = 0; i < n; i++) {
+    sprintf(name, "%d", i + 1);
+    ou_row(o, name);
+    ou_field(o, "operations", p[i].nops);
+    ou_field(o, "seconds", p[i].time);
+    ou_field(o, "bytes", p[i].memoryuse);
+    ou_field(o, "peak", p[i].peak);
+    for (j = 0; j < LMP_NTYPES; j++)
+      ou_field(o, typenames[j], p[i].types[j]);
+  }
+  ou_section(o, "marks");
+  for (i = 0; i < nmarks; i++) {
+    ou_row(o, m[i].label);
+    ou_field(o, "operations", m[i].nops);
+    ou_field(o, "seconds", m[i].time);
+    ou_field(o, "bytes", m[i].memoryuse);
+  }
+  freetimeline(p, m);
+}
+
+/*
+** writes the report in the output file (option output), with all the
+** sections the context has, whatever the detail option. It is called by
+** lmp_stop, so the file is never written by the allocation function.
+*/
+static void writereport(lmp_Context *ctx) {
+  int i;
+  lmp_Output *o = ou_open(ctx->output, ctx->outputformat);
+  if (o == NULL) {
+    fprintf(stderr, "luamemprofiler: cannot open %s\n", ctx->output);
+    return;
+  }
+  ou_section(o, "counters");
+  ou_row(o, "total");
+  ou_field(o, "mallocs", ctx->nallocs);
+  ou_field(o, "mallocbytes", ctx->alloc_size);
+  ou_field(o, "reallocs", ctx->nreallocs);
+  ou_field(o, "reallocbytes", ctx->realloc_size);
+  ou_field(o, "frees", ctx->nfrees);
+  ou_field(o, "freebytes", ctx->free_size);
+  ou_field(o, "memoryuse", ctx->memoryuse);
+  ou_field(o, "maxmemoryuse", ctx->maxmemoryuse);
+
+  ou_section(o, "types");
+  for (i = 0; i < LMP_NTYPES; i++) {
+    lmp_TypeCounters *t = &ctx->types[i];
+    ou_row(o, typenames[i]);
+    ou_field(o, "mallocs", t->nallocs);
+    if (ctx->mode == LMP_MODE_FULL) {
+      ou_field(o, "live", t->live);
+      ou_field(o, "livebytes", t->livesize);
+      ou_field(o, "maxlive", t->maxlive);
+      ou_field(o, "maxlivebytes", t->maxlivesize);
+    }
+  }
+
+  if (ctx->mode == LMP_MODE_SAMPLE) {
+    ou_section(o, "estimate");
+    ou_row(o, "total");
+    ou_field(o, "livebytes", ctx->est_live);
+    ou_field(o, "stderr", sqrt(ctx->est_var));
+    ou_field(o, "interval", ctx->sampleinterval);
+    for (i = 0; i < LMP_NTYPES; i++) {
+      ou_row(o, typenames[i]);
+      ou_field(o, "livebytes", ctx->est_type[i]);
+    }
+  }
+
+  writehistograms(ctx, o);
+  if (ctx->mode == LMP_MODE_FULL)
+    writelifetimes(ctx, o);
+  if (ctx->sites != NULL)
+    writesites(ctx, o);
+  if (ctx->leaks)
+    writeleaks(ctx, o);
+  if (ctx->peak)
+    writepeak(ctx, o);
+  if (ctx->timeline != NULL)
+    writetimeline(ctx, o);
+  if (ctx->gc != NULL)
+    writegc(ctx, o);
+  if (ctx->reallocs)
+    writereallocs(ctx, o);
+  ou_close(o);
+}
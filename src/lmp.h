@@ -6,7 +6,9 @@
 ** See Copyright Notice in COPYRIGHT
 ** 
 ** This module is responsible by defining the new allocation function and
-** by collecting all information about memory management.
+** by collecting all information about memory management. Each profiled
+** lua_State has its own profiler context (lmp_Context), which is the ud of
+** the new allocation function.
 ** At the end of the program execution or when luamemprofiler.stop() is
 ** called, it generates a log containing several memory information.
 **
@@ -15,24 +17,245 @@
 #ifndef LMP_LMP_H
 #define LMP_LMP_H
 
+#include <lua.h>
+
+/* profiling modes */
+#define LMP_MODE_FULL 0      /* keeps one block structure per allocation */
+#define LMP_MODE_COUNTERS 1  /* only counters, sizes come from Lua's osize */
+#define LMP_MODE_SAMPLE 2    /* counters + blocks of sampled allocations */
+
+/* default mean number of bytes between two samples (LMP_MODE_SAMPLE) */
+#define LMP_SAMPLE_INTERVAL 65536
+
+/* type categories of the per type counters (see lmp_gettypes) */
+#define LMP_NTYPES 6  /* string, function, userdata, thread, table, other */
+
+typedef struct lmp_context lmp_Context;
+
 /*
-** Initializes the counters, sets the lowest address of the heap and
-** enables/disables the use of the graphic module (vm_start).
+** counters of one type category. Live counters are kept only in
+** LMP_MODE_FULL, the other modes do not know the type of a freed block.
 */
-void lmp_start (int lowestaddress, float memused, int usegraphics);
+typedef struct lmp_typecounters {
+  long nallocs;      /* number of mallocs */
+  long live;         /* blocks alive now */
+  long livesize;     /* bytes alive now */
+  long maxlive;      /* maximum of live */
+  long maxlivesize;  /* maximum of livesize */
+} lmp_TypeCounters;
+
+/* counters of a context (lmp_getstats) */
+typedef struct lmp_stats {
+  long nallocs, alloc_size;
+  long nreallocs, realloc_size;  /* realloc_size is the sum of the changes */
+  long nfrees, free_size;
+  long memoryuse, maxmemoryuse;
+  lmp_TypeCounters types[LMP_NTYPES];
+} lmp_Stats;
+
+/* live blocks and bytes of a type or site, at some moment (lmp_snapshot) */
+typedef struct lmp_live {
+  long live;
+  long livesize;
+} lmp_Live;
+
+/* memory timeline (option timeline, see lmp_timeline.h) */
+#define LMP_TIMELINE_SIZE 256     /* maximum number of points */
+#define LMP_TIMELINE_MARKS 64     /* marks kept (the last ones) */
+#define LMP_TIMELINE_LABELSIZE 48
+
+/* a point of the memory timeline */
+typedef struct lmp_timepoint {
+  long nops;         /* operations done (mallocs, reallocs and frees) */
+  double time;       /* seconds since lmp_start */
+  long memoryuse;    /* live bytes */
+  long peak;         /* maximum live bytes since the previous point */
+  long types[LMP_NTYPES];  /* live bytes of each type (LMP_MODE_FULL) */
+} lmp_TimePoint;
+
+/* a mark of the memory timeline (lmp_mark) */
+typedef struct lmp_timemark {
+  char label[LMP_TIMELINE_LABELSIZE];
+  long nops;
+  double time;
+  long memoryuse;
+} lmp_TimeMark;
+
+/* garbage collection cycles (option gc, see lmp_gc.h) */
+#define LMP_GC_CYCLES 64  /* cycles kept (the last ones) */
+
+/* statistics of one garbage collection cycle */
+typedef struct lmp_gccycle {
+  long number;       /* cycle number, from 1 */
+  double time;       /* seconds since the end of the previous cycle */
+  long allocated;    /* bytes allocated (mallocs and growing reallocs) */
+  long reclaimed;    /* bytes freed (frees and shrinking reallocs) */
+  long survivors;    /* blocks alive at the end of the cycle */
+  long survivorsize; /* and their bytes */
+  long peak;         /* maximum bytes alive during the cycle */
+  long growth;       /* survivorsize minus that of the previous cycle */
+  double pause;      /* peak / previous survivorsize, in percent */
+} lmp_GCCycle;
+
+/* lmp_start options (see luamemprofiler.c for the Lua side) */
+typedef struct lmp_options {
+  float memused;     /* expected memory consumption (graphic module) */
+  int usegraphics;
+  int mode;          /* LMP_MODE_* */
+  int threadsafe;    /* context may be read by other OS threads (lmp_report) */
+  long sampleinterval;  /* mean bytes between samples (LMP_MODE_SAMPLE) */
+  int detail;        /* adds the detailed sections to the report */
+  lua_State *L;      /* main thread of the profiled lua_State (NULL when
+                        replaying a trace, see lmp_setsite) */
+  int sitedepth;     /* frames of the allocation sites (0 = no sites);
+                        without sitehook, always the stack of L, even for
+                        mallocs done inside coroutines */
+  int sitehook;      /* keeps the sites with hooks instead of walking L */
+  int leaks;         /* reports the blocks alive at lmp_stop (FULL only) */
+  const char *output;  /* file of the JSON/CSV report (NULL = none) */
+  int outputformat;  /* LMP_OUTPUT_* (lmp_output.h) */
+  const char *trace;  /* file of the binary trace (NULL = none) */
+  int tracepolicy;   /* full trace ring: LMP_TRACE_BLOCK, DROP, SAMPLEFULL */
+  long timeline;     /* operations between timeline points (0 = none) */
+  long timelinems;   /* or milliseconds between them (0 = by operations) */
+  int peak;          /* keeps what was alive at the peak (FULL only) */
+  int gc;            /* statistics of each garbage collection cycle */
+  int reallocs;      /* in place and moving reallocs, resizes per block
+                        (FULL only) */
+} lmp_Options;
+
+/*
+** Creates a profiler context: initializes the counters, sets the lowest
+** address of the heap, the profiling mode and enables/disables the use of
+** the graphic module (vm_start). The graphic module requires LMP_MODE_FULL
+** and can be used by one context at a time. 'f' and 'ud' are the lua_State
+** original allocation function and ud, which do the actual memory
+** operations. The context must be used as the ud of lmp_alloc.
+** A threadsafe context protects its data with its own lock (so lua_States
+** running on different OS threads never contend) and is registered for
+** lmp_report.
+** If sitedepth > 0 (LMP_MODE_FULL only), each malloc walks the stack of L
+** to find its allocation site and the report lists the sites. With
+** sitehook, call/return/line hooks of L keep a shadow stack instead, and
+** a malloc reads its site from it. If another hook replaces the one of
+** the profiler, the shadow stack is no longer updated: from then on the
+** sites are found by walking the stack of L, and the report says so.
+** The running coroutine cannot be known from the allocation function, so
+** without sitehook the mallocs done inside coroutines get the site of the
+** main thread (the coroutine.resume call). With sitehook, the hook events
+** tell the running thread, and the mallocs of a coroutine (created after
+** lmp_start, so it inherits the hook) get the site of its own stack.
+** With the trace option, every operation is also recorded in a binary
+** trace file (see lmp_trace.h), written by a background thread and closed
+** by lmp_stop.
+** With the timeline option, the live bytes are sampled every 'timeline'
+** operations (or 'timelinems' milliseconds) in a bounded timeline (see
+** lmp_timeline.h).
+** With the peak option (LMP_MODE_FULL only), the live blocks and bytes of
+** each type, size class and site at the peak of the memory use are kept,
+** and reported by lmp_stop.
+** With the gc option, lmp_gccycle must be called at the end of each garbage
+** collection cycle, and lmp_stop reports the statistics of the cycles.
+** With the reallocs option (LMP_MODE_FULL only), the reallocs that keep the
+** address of the block are told from the ones that move it (and copy the
+** smaller of the two sizes), each block counts its reallocs, and lmp_stop
+** reports how many times the blocks were resized before being freed and
+** the sites whose blocks grew the most.
+*/
+lmp_Context *lmp_start (int lowestaddress, lmp_Options *opt, lua_Alloc f,
+                                                             void *ud);
 
 /*
 ** Finalizes the counters, free all blocks structures, stop the graphic
-** module (vm_stop) [if started] and generates the report (number of: mallocs,
-** frees, tables, ...).
+** module (vm_stop) [if started], generates the report (number of: mallocs,
+** frees, tables, ...; with the leaks option, the blocks still alive grouped
+** by type and site) and frees the context. With the output option, the
+** report is also written in a JSON or CSV file (see lmp_output.h).
+*/
+void lmp_stop (lmp_Context *ctx);
+
+/*
+** Merges the counters of all running threadsafe contexts (possibly running
+** on other OS threads), writes them in the standard output, copies them into
+** 'st' and returns the number of contexts. Counters are only merged here,
+** never in the allocation path, so there is no global peak: the
+** maxmemoryuse of 'st' is the sum of the maximum of each context, an upper
+** bound of the peak of the merged memory use.
+*/
+int lmp_report (lmp_Stats *st);
+
+/*
+** Copies the per type counters of a context into 'tc', which must have
+** LMP_NTYPES entries (string, function, userdata, thread, table, other).
+*/
+void lmp_gettypes (lmp_Context *ctx, lmp_TypeCounters *tc);
+
+/*
+** Copies the counters of a context in O(1).
+*/
+void lmp_getstats (lmp_Context *ctx, lmp_Stats *st);
+
+/*
+** Number of allocation sites of a context (0 without sites).
+*/
+unsigned int lmp_nsites (lmp_Context *ctx);
+
+/*
+** Copies the live counters of a context, which are maintained on each
+** operation: the total, each type (LMP_NTYPES entries, LMP_MODE_FULL only)
+** and the first 'nsites' sites. Returns the number of sites copied (sites
+** created after lmp_nsites was called are left out).
+*/
+unsigned int lmp_snapshot (lmp_Context *ctx, lmp_Live *total,
+                lmp_Live *types, lmp_Live *sites, unsigned int nsites);
+
+/*
+** Replay of a trace (lmp_analyze.c): in a context started with sites and
+** no lua_State, lmp_definesite creates the next site, named 'where' and
+** called from 'parent', and returns its id; lmp_setsite sets the site of
+** the next malloc.
+*/
+unsigned int lmp_definesite (lmp_Context *ctx, unsigned int parent,
+                                               const char *where);
+void lmp_setsite (lmp_Context *ctx, unsigned int site);
+
+/*
+** Adds a labelled mark to the timeline. Returns 0 if the context has no
+** timeline.
+*/
+int lmp_mark (lmp_Context *ctx, const char *label);
+
+/*
+** Copies the timeline points, oldest first, followed by a point of the
+** current moment ('points' must have LMP_TIMELINE_SIZE + 1 entries), and
+** the marks ('marks' must have LMP_TIMELINE_MARKS entries, their number
+** goes to 'nmarks'). 'interval' gets the distance between points, in
+** operations or, if 'clock' gets 1, in milliseconds. Returns the number of
+** points (0 if the context has no timeline).
+*/
+int lmp_gettimeline (lmp_Context *ctx, lmp_TimePoint *points,
+                     lmp_TimeMark *marks, int *nmarks, long *interval,
+                                                       int *clock);
+
+/*
+** Ends a garbage collection cycle of a context started with the gc option
+** (see lmp_gc.h).
+*/
+void lmp_gccycle (lmp_Context *ctx);
+
+/*
+** Writes the frames of a site (innermost first) in 'buf', truncated to
+** 'size' bytes.
 */
-void lmp_stop ();
+void lmp_sitename (lmp_Context *ctx, unsigned int site, char *buf,
+                                                        size_t size);
 
 /*
-** Checks the alloc type (malloc, free, realloc) and update data in
-** accordance. Create, remove or update block structures, update report
-** counters (mallocs, tables, etc.) and call vm_newmemop if graphic
-** module is enabled.
+** Checks the alloc type (malloc, free, realloc), forwards the operation to
+** the original allocation function (with the original ud) and update data in
+** accordance. 'ud' is the lmp_Context returned by lmp_start. Create, remove
+** or update block structures, update report counters (mallocs, tables, etc.)
+** and call vm_newmemop if graphic module is enabled.
 */
 void *lmp_alloc (void *ud, void *ptr, size_t osize, size_t nsize);
 
@@ -0,0 +1,181 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** Offline analyzer of the traces written with the trace option (see
+** lmp_trace.h). The trace is replayed in a "full" mode profiler context,
+** with no Lua running: the allocation function of the context returns the
+** addresses recorded in the trace, so the report is the one lmp.stop would
+** have written. The trace is read as a stream; like the profiler, the
+** analyzer keeps only the blocks alive, whatever the length of the trace.
+**   lmpanalyze [-d] [-l] [-p] [-r] [-t ms] [-o file] trace
+**     -d       detailed sections (option detail)
+**     -l       blocks alive at the end, by type and site (option leaks)
+**     -p       live memory at the peak, by type, size class and site
+**     -r       reallocs in place and moving, reallocs per block and sites
+**              of repeated growth (option reallocs)
+**     -t ms    live memory every 'ms' milliseconds of the trace
+**     -o file  JSON or CSV report with all sites (option output)
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+
+#include "lmp.h"
+#include "lmp_output.h"
+#include "lmp_trace.h"
+#include "vmemory.h"
+
+/* a Lua type of each type index, given to lmp_alloc on mallocs */
+static const int luatypes[LMP_NTYPES] = {
+  LUA_TSTRING, LUA_TFUNCTION, LUA_TUSERDATA, LUA_TTHREAD, LUA_TTABLE,
+  LUA_TNONE
+};
+
+
+/*
+** the replay context never starts the graphic module (usegraphics is 0):
+** these stand for vmemory.c, so the analyzer does not link SDL
+*/
+void vm_start (int lowestaddress, float memused) {
+  (void) lowestaddress;
+  (void) memused;
+}
+
+void vm_stop () {
+}
+
+void vm_newmemop (int memop, void *ptr, size_t luatype, size_t size) {
+  (void) memop;
+  (void) ptr;
+  (void) luatype;
+  (void) size;
+}
+
+
+/*
+** allocation function of the replay context: the operation already
+** happened, it returns the new address recorded in the trace. 'ud' is the
+** event being replayed.
+*/
+static void *replayalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  lmp_TraceEvent *ev = (lmp_TraceEvent *) ud;
+  (void) ptr;
+  (void) osize;
+  if (nsize == 0)
+    return NULL;
+  return (void *) (ev->kind == LMP_TRACE_REALLOC ? ev->nptr : ev->ptr);
+}
+
+/* replays a record in 'ctx' ('ev' is the ud of its allocation function) */
+static void replay (lmp_Context *ctx, lmp_TraceEvent *ev, int sites) {
+  switch (ev->kind) {
+    case LMP_TRACE_SITE:
+      if (sites)
+        lmp_definesite(ctx, ev->parent, ev->where);
+      break;
+    case LMP_TRACE_MALLOC:
+      if (sites)
+        lmp_setsite(ctx, ev->site);
+      lmp_alloc(ctx, NULL, (size_t) luatypes[ev->type < LMP_NTYPES ?
+                                     ev->type : LMP_NTYPES - 1], ev->nsize);
+      break;
+    case LMP_TRACE_FREE:
+      lmp_alloc(ctx, (void *) ev->ptr, ev->osize, 0);
+      break;
+    case LMP_TRACE_REALLOC:
+      lmp_alloc(ctx, (void *) ev->ptr, ev->osize, ev->nsize);
+      break;
+  }
+}
+
+/* writes a line of the live memory over time */
+static void printtimeline (lmp_Context *ctx, uint64_t time) {
+  lmp_Stats st;
+  lmp_TypeCounters *t = st.types;
+  lmp_getstats(ctx, &st);
+printf("  %lu: %ld | %ld %ld %ld %ld %ld %ld\n", (unsigned long) (time / 1000000), st.memoryuse, t[0].livesize, t[1].livesize, t[2].livesize, t[3].livesize, t[4].livesize, t[5].livesize);
+}
+
+static int usage (void) {
+  fprintf(stderr,
+    "usage: lmpanalyze [-d] [-l] [-p] [-r] [-t ms] [-o file] trace\n"
+    "  -d       detailed sections\n"
+    "  -l       blocks alive at the end, by type and site\n"
+    "  -p       live memory at the peak, by type, size and site\n"
+    "  -r       reallocs in place and moving, reallocs per block\n"
+    "  -t ms    live memory every 'ms' milliseconds\n"
+    "  -o file  JSON or CSV (.csv) report\n");
+  return 1;
+}
+
+int main (int argc, char **argv) {
+  lmp_TraceEvent ev;
+  lmp_Options opt;
+  lmp_Context *ctx;
+  lmp_TraceReader *r;
+  const char *path = NULL;
+  uint64_t tick = 0, next = 0;
+  long n = 0, dropped, sampled;
+  int i, kind, flags, sites;
+
+  memset(&opt, 0, sizeof(opt));
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0) {
+      opt.detail = 1;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      opt.leaks = 1;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      opt.peak = 1;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      opt.reallocs = 1;
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      tick = (uint64_t) (atof(argv[++i]) * 1000000);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      size_t l;
+      opt.output = argv[++i];
+      l = strlen(opt.output);
+      opt.outputformat = (l >= 4 && strcmp(opt.output + l - 4, ".csv") == 0)
+                         ? LMP_OUTPUT_CSV : LMP_OUTPUT_JSON;
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      return usage();
+    }
+  }
+  if (path == NULL)
+    return usage();
+  r = tr_openreader(path, &flags);
+  if (r == NULL) {
+    fprintf(stderr, "lmpanalyze: %s is not a luamemprofiler trace\n", path);
+    return 1;
+  }
+  sites = (flags & LMP_TRACE_SITES) != 0;
+  opt.sitedepth = sites;  /* sites come from the trace (opt.L is NULL) */
+  ctx = lmp_start(0, &opt, replayalloc, &ev);
+
+  if (tick > 0)
+printf("Live Memory over Time (ms: bytes | string function userdata thread table other):\n");
+  while ((kind = tr_read(r, &ev)) >= 0) {
+    if (tick > 0 && kind != LMP_TRACE_SITE && ev.time >= next) {
+      printtimeline(ctx, ev.time);
+      next = (ev.time / tick + 1) * tick;
+    }
+    replay(ctx, &ev, sites);
+    if (kind != LMP_TRACE_SITE)
+      n++;
+  }
+  if (kind == LMP_TRACE_ERROR)
+    fprintf(stderr, "lmpanalyze: trace cut short, report of the first %ld "
+                    "operations\n", n);
+  tr_losses(r, &dropped, &sampled);
+  tr_closereader(r);
+  if (dropped > 0 || sampled > 0)
+    printf("\nThe trace lost %ld operations (%ld dropped, %ld sampled out)\n",
+           dropped + sampled, dropped, sampled);
+  lmp_stop(ctx);
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** See lmp_gc.h for module overview
+**
+*/
+
+#define _POSIX_C_SOURCE 199506L  /* clock_gettime */
+
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "lmp_gc.h"
+#include "lmp_struct.h"
+
+struct lmp_gc {
+  long peak;          /* maximum live bytes of the current cycle */
+  uint64_t start;     /* time of the previous boundary (or of gc_new) */
+  long allocated;     /* counters at the previous boundary */
+  long reclaimed;
+  long memoryuse;
+  long ncycles;       /* cycles ended (the ring keeps the last ones) */
+  lmp_GCCycle total;
+  lmp_GCCycle cycles[LMP_GC_CYCLES];
+};
+
+
+/* monotonic clock in nanoseconds */
+static uint64_t now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+lmp_GC *gc_new (void) {
+  lmp_GC *g = (lmp_GC *) st_rawalloc(sizeof(lmp_GC));
+  g->start = now();
+  return g;
+}
+
+void gc_destroy (lmp_GC *g) {
+  st_rawfree(g, sizeof(lmp_GC));
+}
+
+void gc_update (lmp_GC *g, long memoryuse) {
+  if (memoryuse > g->peak)
+    g->peak = memoryuse;
+}
+
+void gc_cycle (lmp_GC *g, long allocated, long reclaimed, long live,
+                                                          long memoryuse) {
+  uint64_t time = now();
+  lmp_GCCycle *c = &g->cycles[g->ncycles++ % LMP_GC_CYCLES];
+  lmp_GCCycle *t = &g->total;
+  c->number = g->ncycles;
+  c->time = (time - g->start) / 1e9;
+  c->allocated = allocated - g->allocated;
+  c->reclaimed = reclaimed - g->reclaimed;
+  c->survivors = live;
+  c->survivorsize = memoryuse;
+  c->peak = g->peak;
+  c->growth = memoryuse - g->memoryuse;
+  /* the peak over the live bytes after the previous cycle (the pause) */
+  c->pause = g->memoryuse > 0 ? 100.0 * g->peak / g->memoryuse : 0;
+
+  t->number = g->ncycles;
+  t->time += c->time;
+  t->allocated += c->allocated;
+  t->reclaimed += c->reclaimed;
+  t->growth += c->growth;
+  if (c->survivors > t->survivors)
+    t->survivors = c->survivors;
+  if (c->survivorsize > t->survivorsize)
+    t->survivorsize = c->survivorsize;
+  if (c->peak > t->peak)
+    t->peak = c->peak;
+  if (c->pause > t->pause)
+    t->pause = c->pause;
+
+  g->start = time;
+  g->allocated = allocated;
+  g->reclaimed = reclaimed;
+  g->memoryuse = memoryuse;
+  g->peak = memoryuse;
+}
+
+int gc_cycles (lmp_GC *g, lmp_GCCycle *v) {
+  long i, first = g->ncycles > LMP_GC_CYCLES ?
+                  g->ncycles - LMP_GC_CYCLES : 0;
+  for (i = first; i < g->ncycles; i++)
+    v[i - first] = g->cycles[i % LMP_GC_CYCLES];
+  return (int) (g->ncycles - first);
+}
+
+void gc_total (lmp_GC *g, lmp_GCCycle *total) {
+  *total = g->total;
+}
@@ -0,0 +1,56 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** This module is responsible by the statistics of the garbage collection
+** cycles (option gc). The cycle boundaries are found by the Lua side (see
+** luamemprofiler.c): a sentinel object with a finalizer is left unreachable,
+** so the collector finalizes it at the end of each cycle, and its finalizer
+** creates the sentinel of the next cycle. At each boundary the counters of
+** the context give the bytes allocated and reclaimed during the cycle, the
+** bytes that survived it and the heap growth since the previous boundary.
+** The last LMP_GC_CYCLES cycles are kept, plus the totals of all of them.
+**
+*/
+
+#ifndef LMP_LMPGC_H
+#define LMP_LMPGC_H
+
+#include "lmp.h"
+
+typedef struct lmp_gc lmp_GC;
+
+
+lmp_GC *gc_new (void);
+
+void gc_destroy (lmp_GC *g);
+
+/*
+** Called after each memory operation: keeps the maximum live bytes of the
+** current cycle.
+*/
+void gc_update (lmp_GC *g, long memoryuse);
+
+/*
+** Ends the current cycle. 'allocated' and 'reclaimed' are the bytes
+** allocated and freed since lmp_start (mallocs and growing reallocs, frees
+** and shrinking reallocs), 'live' and 'memoryuse' the blocks and bytes
+** alive now.
+*/
+void gc_cycle (lmp_GC *g, long allocated, long reclaimed, long live,
+                                                          long memoryuse);
+
+/*
+** Copies the last cycles, oldest first, and returns their number. 'v' must
+** have LMP_GC_CYCLES entries.
+*/
+int gc_cycles (lmp_GC *g, lmp_GCCycle *v);
+
+/*
+** Gets the sums of the time, allocated, reclaimed and growth fields and
+** the maximum of the others over all cycles; 'number' is the number of
+** cycles.
+*/
+void gc_total (lmp_GC *g, lmp_GCCycle *total);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** See lmp_output.h for module overview
+**
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lmp_output.h"
+#include "lmp_struct.h"
+
+#define OUTPUT_BUFSIZE 65536  /* stdio buffer of the file */
+#define OUTPUT_NAMESIZE 1024  /* longer row names are truncated */
+
+struct lmp_output {
+  FILE *f;
+  int format;       /* LMP_OUTPUT_* */
+  char *buf;        /* stdio buffer (raw memory, not from the lua_State) */
+  int nsections;    /* sections written */
+  int nrows;        /* rows written in the current section */
+  char section[64];
+  char name[OUTPUT_NAMESIZE];  /* current row */
+};
+
+
+/* writes a string as a JSON string */
+static void jsonstring (FILE *f, const char *s) {
+  putc('"', f);
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      putc(c, f);
+  }
+  putc('"', f);
+}
+
+/* writes a string as a CSV field, quoted if needed */
+static void csvstring (FILE *f, const char *s) {
+  if (strpbrk(s, ",\"\r\n") == NULL) {
+    fputs(s, f);
+    return;
+  }
+  putc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"')
+      putc('"', f);
+    putc(*s, f);
+  }
+  putc('"', f);
+}
+
+/* integers are written without the decimal part */
+static void number (FILE *f, double value) {
+  if (value > -1e15 && value < 1e15 && value == (double) (long) value)
+    fprintf(f, "%ld", (long) value);
+  else
+    fprintf(f, "%.17g", value);
+}
+
+/* ends the current row (JSON only, CSV rows are closed by each field) */
+static void endrow (lmp_Output *o) {
+  if (o->format == LMP_OUTPUT_JSON && o->nrows > 0)
+    fputs("}", o->f);
+}
+
+/* ends the current section */
+static void endsection (lmp_Output *o) {
+  endrow(o);
+  if (o->format == LMP_OUTPUT_JSON && o->nsections > 0)
+    fputs("\n  ]", o->f);
+}
+
+lmp_Output *ou_open (const char *path, int format) {
+  lmp_Output *o;
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return NULL;
+  o = (lmp_Output *) st_rawalloc(sizeof(lmp_Output));
+  o->f = f;
+  o->format = format;
+  o->buf = (char *) st_rawalloc(OUTPUT_BUFSIZE);
+  setvbuf(f, o->buf, _IOFBF, OUTPUT_BUFSIZE);
+  if (format == LMP_OUTPUT_JSON)
+    fputs("{", f);
+  else
+    fputs("section,name,field,value\n", f);
+  return o;
+}
+
+void ou_close (lmp_Output *o) {
+  endsection(o);
+  if (o->format == LMP_OUTPUT_JSON)
+    fputs("\n}\n", o->f);
+  fclose(o->f);  /* flushes before the buffer is freed */
+  st_rawfree(o->buf, OUTPUT_BUFSIZE);
+  st_rawfree(o, sizeof(lmp_Output));
+}
+
+void ou_section (lmp_Output *o, const char *section) {
+  endsection(o);
+  if (o->format == LMP_OUTPUT_JSON) {
+    fputs(o->nsections > 0 ? ",\n  " : "\n  ", o->f);
+    jsonstring(o->f, section);
+    fputs(": [", o->f);
+  }
+  o->nsections++;
+  o->nrows = 0;
+  strncpy(o->section, section, sizeof(o->section) - 1);
+}
+
+void ou_row (lmp_Output *o, const char *name) {
+  endrow(o);
+  if (o->format == LMP_OUTPUT_JSON) {
+    fputs(o->nrows > 0 ? ",\n    {\"name\": " : "\n    {\"name\": ", o->f);
+    jsonstring(o->f, name);
+  }
+  o->nrows++;
+  strncpy(o->name, name, sizeof(o->name) - 1);
+}
+
+void ou_field (lmp_Output *o, const char *field, double value) {
+  if (o->format == LMP_OUTPUT_JSON) {
+    fputs(", ", o->f);
+    jsonstring(o->f, field);
+    fputs(": ", o->f);
+  } else {
+    csvstring(o->f, o->section);
+    putc(',', o->f);
+    csvstring(o->f, o->name);
+    putc(',', o->f);
+    csvstring(o->f, field);
+    putc(',', o->f);
+  }
+  number(o->f, value);
+  if (o->format == LMP_OUTPUT_CSV)
+    putc('\n', o->f);
+}
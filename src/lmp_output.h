@@ -0,0 +1,50 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** This module is responsible by writing the report in a file, in a format
+** meant for other programs (JSON or CSV). The report is a list of sections
+** (counters, types, sites, ...), each one a list of rows, each row a name
+** and numeric fields:
+**   JSON: {"section": [{"name": "row", "field": value, ...}, ...], ...}
+**   CSV:  one line per field: section,name,field,value
+** The file is written with a large stdio buffer, only when the report is
+** generated (never by the allocation function).
+**
+*/
+
+#ifndef LMP_LMPOUTPUT_H
+#define LMP_LMPOUTPUT_H
+
+/* output formats */
+#define LMP_OUTPUT_JSON 0
+#define LMP_OUTPUT_CSV 1
+
+typedef struct lmp_output lmp_Output;
+
+/*
+** Opens (truncates) the file 'path'. Returns NULL if it cannot be opened.
+*/
+lmp_Output *ou_open (const char *path, int format);
+
+/*
+** Writes the end of the report and closes the file.
+*/
+void ou_close (lmp_Output *o);
+
+/*
+** Starts a new section, ending the previous one.
+*/
+void ou_section (lmp_Output *o, const char *section);
+
+/*
+** Starts a new row of the current section, ending the previous one.
+*/
+void ou_row (lmp_Output *o, const char *name);
+
+/*
+** Writes a field of the current row.
+*/
+void ou_field (lmp_Output *o, const char *field, double value);
+
+#endif
@@ -0,0 +1,515 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** Allocator benchmark driven by the traces written with the trace option
+** (see lmp_trace.h): replays the exact sequence of mallocs, reallocs and
+** frees the profiled lua_State did, with no Lua running, on one allocator:
+**   malloc  the C library malloc, realloc and free
+**   pool    a size class pool built in this tool (blocks up to POOL_MAXSIZE
+**           bytes from mmap'ed chunks, larger ones from malloc)
+** The standalone Lua interpreter allocates with the C library realloc and
+** free (lauxlib l_alloc), so "malloc" measures it too; another malloc (e.g.
+** the one linked into a host program) can be measured with LD_PRELOAD.
+** The trace is read in batches: each batch is first decoded (trace
+** addresses become slots of the replay) and then replayed, and the clock
+** runs only around each allocator call. Like a Lua program, the replay
+** writes to every page it gets, out of the clock.
+**   lmpreplay [-a malloc|pool] trace
+** writes the time per operation, the peak resident memory (RSS, sampled
+** between batches, less the memory of the tool itself) and the
+** fragmentation at that moment: the part of it that was not live blocks.
+**
+*/
+
+#define _POSIX_C_SOURCE 199506L  /* clock_gettime, sysconf */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lmp_struct.h"
+#include "lmp_trace.h"
+
+#define REPLAY_BATCH 4096       /* operations decoded and replayed at once */
+#define REPLAY_MINSLOTS 1024    /* initial size of the slot and map arrays */
+#define REPLAY_PAGE 4096        /* the replay writes a byte every page */
+#define REPLAY_CALIBRATION 1000 /* clock reads to find the cost of one */
+
+#define POOL_MAXSIZE 512        /* larger blocks come from malloc */
+#define POOL_ALIGN 16           /* size classes are multiples of 16 */
+#define POOL_NCLASSES (POOL_MAXSIZE / POOL_ALIGN)
+#define POOL_CHUNK 65536        /* bytes the pool takes from the system */
+
+#define ALLOC_MALLOC 0
+#define ALLOC_POOL 1
+
+/* allocation function being measured (same as lua_Alloc) */
+typedef void *(*lmp_ReplayAlloc) (void *ud, void *ptr, size_t osize,
+                                                       size_t nsize);
+
+static const char *const allocnames[] = {"malloc", "pool", NULL};
+
+/* an operation of a batch (slots are the live blocks of the replay) */
+typedef struct lmp_replayop {
+  int kind;        /* LMP_TRACE_FREE, MALLOC or REALLOC */
+  size_t slot;
+  size_t osize;
+  size_t nsize;
+} lmp_ReplayOp;
+
+/*
+** trace address -> slot (open addressing, linear probing, 0 is an empty
+** entry) and slot -> address and size of the block in the replay. Freed
+** slots are reused.
+*/
+typedef struct lmp_replaymap {
+  uintptr_t *keys;
+  size_t *values;
+  size_t size;        /* entries of keys and values (power of 2) */
+  size_t n;           /* live blocks */
+  char **slots;
+  size_t *sizes;
+  size_t *freeslots;  /* stack of free slots */
+  size_t nfree;
+  size_t nslots;      /* slots used so far */
+  size_t sizeslots;   /* entries of slots, sizes and freeslots */
+} lmp_ReplayMap;
+
+/* free block of the pool (the list link is kept in the block) */
+typedef struct lmp_poolblock {
+  struct lmp_poolblock *next;
+} lmp_PoolBlock;
+
+/* size class pool: free lists plus a chunk being carved */
+typedef struct lmp_pool {
+  lmp_PoolBlock *free[POOL_NCLASSES];
+  char *chunk;      /* unused part of the last chunk */
+  size_t left;      /* its bytes */
+  void **chunks;    /* all chunks, released at the end */
+  size_t nchunks;
+  size_t sizechunks;
+} lmp_Pool;
+
+static lmp_Pool pool;
+
+/* memory taken from the system by the tool (not by the allocator measured) */
+static long toolbytes;
+
+/* nanoseconds between two back to back clock reads (see clockcost) */
+static uint64_t clockread;
+
+
+/* monotonic clock in nanoseconds */
+static uint64_t now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+** cost of reading the clock around an operation: the least of many
+** back to back reads, subtracted from the time of each operation
+*/
+static uint64_t clockcost (void) {
+  uint64_t t, least = (uint64_t) -1;
+  int i;
+  for (i = 0; i < REPLAY_CALIBRATION; i++) {
+    t = now();
+    t = now() - t;
+    if (t < least)
+      least = t;
+  }
+  return least;
+}
+
+/* resident memory of the process in bytes, -1 if unknown (no /proc) */
+static long residentmemory (void) {
+  long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL)
+    return -1;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    resident = -1;
+  fclose(f);
+  return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+static void *toolalloc (size_t size) {
+  toolbytes += (long) size;
+  return st_rawalloc(size);
+}
+
+static void toolfree (void *p, size_t size) {
+  toolbytes -= (long) size;
+  st_rawfree(p, size);
+}
+
+/* grows an array of 'n' elements of 'size' bytes to 'nn' elements */
+static void *toolgrow (void *p, size_t n, size_t nn, size_t size) {
+  void *np = toolalloc(nn * size);
+  if (p != NULL) {
+    memcpy(np, p, n * size);
+    toolfree(p, n * size);
+  }
+  return np;
+}
+
+
+/*
+** The allocators. Like lua_Alloc, all of them get the old size: the pool
+** keeps no header in its blocks.
+*/
+
+static void *mallocalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  (void) ud;
+  (void) osize;
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (ptr == NULL)
+    return malloc(nsize);
+  return realloc(ptr, nsize);
+}
+
+/* size class of 'size' (sizes from 1 to POOL_MAXSIZE) */
+static int poolclass (size_t size) {
+  return (int) ((size - 1) / POOL_ALIGN);
+}
+
+static void *poolget (lmp_Pool *p, int c) {
+  size_t size = (size_t) (c + 1) * POOL_ALIGN;
+  lmp_PoolBlock *b = p->free[c];
+  if (b != NULL) {
+    p->free[c] = b->next;
+    return b;
+  }
+  if (p->left < size) {  /* the rest of the chunk is left unused */
+    if (p->nchunks == p->sizechunks) {
+      size_t nsize = p->sizechunks == 0 ? 64 : p->sizechunks * 2;
+      p->chunks = (void **) toolgrow(p->chunks, p->sizechunks, nsize,
+                                     sizeof(void *));
+      p->sizechunks = nsize;
+    }
+    p->chunk = (char *) st_rawalloc(POOL_CHUNK);
+    p->chunks[p->nchunks++] = p->chunk;
+    p->left = POOL_CHUNK;
+  }
+  p->chunk += size;
+  p->left -= size;
+  return p->chunk - size;
+}
+
+static void poolput (lmp_Pool *p, void *ptr, int c) {
+  lmp_PoolBlock *b = (lmp_PoolBlock *) ptr;
+  b->next = p->free[c];
+  p->free[c] = b;
+}
+
+static void *poolalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  lmp_Pool *p = (lmp_Pool *) ud;
+  void *np;
+  if (ptr == NULL)
+    osize = 0;
+  if (nsize == 0) {
+    if (osize > POOL_MAXSIZE)
+      free(ptr);
+    else if (ptr != NULL)
+      poolput(p, ptr, poolclass(osize));
+    return NULL;
+  }
+  if (osize > POOL_MAXSIZE && nsize > POOL_MAXSIZE)
+    return realloc(ptr, nsize);
+  if (osize > 0 && osize <= POOL_MAXSIZE && nsize <= POOL_MAXSIZE &&
+      poolclass(osize) == poolclass(nsize))
+    return ptr;  /* same class: in place */
+  np = nsize > POOL_MAXSIZE ? malloc(nsize) : poolget(p, poolclass(nsize));
+  if (np != NULL && ptr != NULL) {
+    memcpy(np, ptr, osize < nsize ? osize : nsize);
+    poolalloc(p, ptr, osize, 0);
+  }
+  return np;
+}
+
+static void pooldestroy (lmp_Pool *p) {
+  size_t i;
+  for (i = 0; i < p->nchunks; i++)
+    st_rawfree(p->chunks[i], POOL_CHUNK);
+  if (p->chunks != NULL)
+    toolfree(p->chunks, p->sizechunks * sizeof(void *));
+  memset(p, 0, sizeof(lmp_Pool));
+}
+
+
+/*
+** Map of the trace addresses (decoding, out of the clock).
+*/
+
+static size_t hashaddress (lmp_ReplayMap *m, uintptr_t key) {
+  return (size_t) ((key >> 4) * 2654435761u) & (m->size - 1);
+}
+
+/* returns the entry of 'key', or the empty entry where it would go */
+static size_t findentry (lmp_ReplayMap *m, uintptr_t key) {
+  size_t i = hashaddress(m, key);
+  while (m->keys[i] != 0 && m->keys[i] != key)
+    i = (i + 1) & (m->size - 1);
+  return i;
+}
+
+static void newmap (lmp_ReplayMap *m, size_t size) {
+  m->keys = (uintptr_t *) toolalloc(size * sizeof(uintptr_t));
+  m->values = (size_t *) toolalloc(size * sizeof(size_t));
+  m->size = size;
+}
+
+static void freemap (lmp_ReplayMap *m) {
+  toolfree(m->keys, m->size * sizeof(uintptr_t));
+  toolfree(m->values, m->size * sizeof(size_t));
+}
+
+static void mapinsert (lmp_ReplayMap *m, uintptr_t key, size_t slot) {
+  size_t i;
+  if (2 * (m->n + 1) > m->size) {  /* keeps the load under 1/2 */
+    lmp_ReplayMap old = *m;
+    newmap(m, old.size * 2);
+    for (i = 0; i < old.size; i++) {
+      if (old.keys[i] != 0) {
+        size_t j = findentry(m, old.keys[i]);
+        m->keys[j] = old.keys[i];
+        m->values[j] = old.values[i];
+      }
+    }
+    freemap(&old);
+  }
+  i = findentry(m, key);
+  if (m->keys[i] == 0)
+    m->n++;
+  m->keys[i] = key;
+  m->values[i] = slot;
+}
+
+/* removes 'key' and returns its slot, or (size_t) -1 if it is not mapped */
+static size_t mapremove (lmp_ReplayMap *m, uintptr_t key) {
+  size_t i = findentry(m, key), j, slot;
+  if (m->keys[i] == 0)
+    return (size_t) -1;
+  slot = m->values[i];
+  m->keys[i] = 0;
+  m->n--;
+  /* shifts back the entries after it, so no probe sequence is broken */
+  for (j = (i + 1) & (m->size - 1); m->keys[j] != 0;
+       j = (j + 1) & (m->size - 1)) {
+    size_t home = hashaddress(m, m->keys[j]);
+    if (((j - home) & (m->size - 1)) >= ((j - i) & (m->size - 1))) {
+      m->keys[i] = m->keys[j];
+      m->values[i] = m->values[j];
+      m->keys[j] = 0;
+      i = j;
+    }
+  }
+  return slot;
+}
+
+static size_t newslot (lmp_ReplayMap *m) {
+  if (m->nfree > 0)
+    return m->freeslots[--m->nfree];
+  if (m->nslots == m->sizeslots) {
+    size_t nsize = m->sizeslots * 2;
+    m->slots = (char **) toolgrow(m->slots, m->sizeslots, nsize,
+                                  sizeof(char *));
+    m->sizes = (size_t *) toolgrow(m->sizes, m->sizeslots, nsize,
+                                   sizeof(size_t));
+    m->freeslots = (size_t *) toolgrow(m->freeslots, m->sizeslots, nsize,
+                                       sizeof(size_t));
+    m->sizeslots = nsize;
+  }
+  return m->nslots++;
+}
+
+
+/* writes a byte in each page of [p + from, p + to) */
+static void touch (char *p, size_t from, size_t to) {
+  for (; from < to; from += REPLAY_PAGE)
+    p[from] = 1;
+}
+
+/*
+** replays a batch, returns the nanoseconds spent in the allocator. Only
+** the calls are timed: the pages are touched right after each one, since
+** a later operation of the batch may free the block.
+*/
+static uint64_t replaybatch (lmp_ReplayAlloc f, void *ud, lmp_ReplayMap *m,
+                             lmp_ReplayOp *ops, int n) {
+  char **slots = m->slots;
+  uint64_t start, t, elapsed = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    lmp_ReplayOp *op = &ops[i];
+    char *p = slots[op->slot];
+    start = now();
+    p = (char *) f(ud, op->kind == LMP_TRACE_MALLOC ? NULL : p, op->osize,
+                   op->nsize);
+    t = now() - start;
+    elapsed += t > clockread ? t - clockread : 0;
+    if (p == NULL && op->nsize > 0) {
+      fprintf(stderr, "lmpreplay: out of memory (%lu bytes)\n",
+              (unsigned long) op->nsize);
+      exit(1);
+    }
+    if (op->kind != LMP_TRACE_FREE)
+      touch(p, op->osize, op->nsize);
+    slots[op->slot] = p;
+  }
+  return elapsed;
+}
+
+static int usage (void) {
+  fprintf(stderr,
+    "usage: lmpreplay [-a malloc|pool] trace\n"
+    "  -a  allocator: the C library (default) or the built-in pool\n");
+  return 1;
+}
+
+int main (int argc, char **argv) {
+  lmp_TraceEvent ev;
+  lmp_TraceReader *r;
+  lmp_ReplayMap m;
+  lmp_ReplayOp *ops;
+  lmp_ReplayAlloc f;
+  void *ud = NULL;
+  const char *path = NULL;
+  uint64_t elapsed = 0;
+  long counts[3] = {0, 0, 0}, nops, unmatched = 0;
+  long live = 0, maxlive = 0, peaklive = 0, base, rss, peakrss = -1;
+  size_t j;
+  int i, kind, n = 0, allocator = ALLOC_MALLOC;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      for (allocator = 0; allocnames[allocator] != NULL; allocator++)
+        if (strcmp(argv[i + 1], allocnames[allocator]) == 0)
+          break;
+      if (allocnames[allocator] == NULL)
+        return usage();
+      i++;
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      return usage();
+    }
+  }
+  if (path == NULL)
+    return usage();
+  r = tr_openreader(path, NULL);
+  if (r == NULL) {
+    fprintf(stderr, "lmpreplay: %s is not a luamemprofiler trace\n", path);
+    return 1;
+  }
+  if (allocator == ALLOC_POOL) {
+    f = poolalloc;
+    ud = &pool;
+  } else {
+    f = mallocalloc;
+  }
+  clockread = clockcost();
+
+  memset(&m, 0, sizeof(m));
+  newmap(&m, REPLAY_MINSLOTS);
+  m.sizeslots = REPLAY_MINSLOTS / 2;
+  m.slots = (char **) toolalloc(m.sizeslots * sizeof(char *));
+  m.sizes = (size_t *) toolalloc(m.sizeslots * sizeof(size_t));
+  m.freeslots = (size_t *) toolalloc(m.sizeslots * sizeof(size_t));
+  ops = (lmp_ReplayOp *) toolalloc(REPLAY_BATCH * sizeof(lmp_ReplayOp));
+  base = residentmemory() - toolbytes;
+
+  do {
+    kind = tr_read(r, &ev);
+    if (kind == LMP_TRACE_MALLOC || kind == LMP_TRACE_REALLOC ||
+        kind == LMP_TRACE_FREE) {
+      lmp_ReplayOp *op = &ops[n];
+      size_t slot = kind == LMP_TRACE_MALLOC ? (size_t) -1 :
+                                               mapremove(&m, ev.ptr);
+      op->kind = kind;
+      op->osize = slot != (size_t) -1 ? m.sizes[slot] : 0;
+      op->nsize = kind == LMP_TRACE_FREE ? 0 : ev.nsize;
+      if (slot == (size_t) -1 && kind != LMP_TRACE_MALLOC) {
+        /* block not in the map: allocated before the trace started, or
+           its malloc was lost by the writer */
+        unmatched++;
+        if (kind == LMP_TRACE_FREE)
+          continue;
+        op->kind = LMP_TRACE_MALLOC;
+        ev.ptr = ev.nptr;
+      }
+      if (op->kind == LMP_TRACE_MALLOC) {
+        /* a block still mapped at this address lost its free: frees it */
+        slot = mapremove(&m, ev.ptr);
+        if (slot != (size_t) -1) {
+          unmatched++;
+          m.freeslots[m.nfree++] = slot;
+          ops[n + 1] = *op;
+          op->kind = LMP_TRACE_FREE;
+          op->slot = slot;
+          op->osize = m.sizes[slot];
+          op->nsize = 0;
+          counts[LMP_TRACE_FREE]++;
+          live -= (long) op->osize;
+          op = &ops[++n];
+        }
+        slot = newslot(&m);
+      }
+      op->slot = slot;
+      counts[op->kind]++;
+      live += (long) op->nsize - (long) op->osize;
+      if (live > maxlive)
+        maxlive = live;
+      if (op->kind == LMP_TRACE_FREE) {
+        m.freeslots[m.nfree++] = slot;
+      } else {
+        m.sizes[slot] = op->nsize;
+        mapinsert(&m, kind == LMP_TRACE_REALLOC ? ev.nptr : ev.ptr, slot);
+      }
+      n++;
+    }
+    if (n >= REPLAY_BATCH - 1 || (kind < 0 && n > 0)) {
+      elapsed += replaybatch(f, ud, &m, ops, n);
+      n = 0;
+      rss = residentmemory() - toolbytes - base;
+      if (rss > peakrss) {
+        peakrss = rss;
+        peaklive = live;
+      }
+    }
+  } while (kind >= 0);
+  if (kind == LMP_TRACE_ERROR)
+    fprintf(stderr, "lmpreplay: trace cut short, replay of its first part\n");
+  tr_closereader(r);
+
+  nops = counts[0] + counts[1] + counts[2];
+printf("Replay of %s with %s: %ld operations (%ld mallocs, %ld reallocs, %ld frees)\n", path, allocnames[allocator], nops, counts[LMP_TRACE_MALLOC], counts[LMP_TRACE_REALLOC], counts[LMP_TRACE_FREE]);
+printf("Time=%.1f ns/op\tTotal=%.3f ms\n", nops > 0 ? (double) elapsed / nops : 0.0, elapsed / 1e6);
+printf("Maximum Live Memory=%ld bytes\n", maxlive);
+  if (peakrss > 0)
+printf("Peak RSS=%ld bytes\tLive Then=%ld bytes\tFragmentation=%.1f%%\n", peakrss, peaklive, peaklive < peakrss ? 100.0 * (peakrss - peaklive) / peakrss : 0.0);
+  else
+printf("Peak RSS=unknown (no /proc/self/statm)\n");
+  if (unmatched > 0)
+printf("Operations on blocks not allocated in the trace=%ld\n", unmatched);
+
+  /* releases the blocks still alive, so no allocator leaks into another run */
+  for (j = 0; j < m.size; j++)
+    if (m.keys[j] != 0)
+      f(ud, m.slots[m.values[j]], m.sizes[m.values[j]], 0);
+  if (allocator == ALLOC_POOL)
+    pooldestroy(&pool);
+  freemap(&m);
+  toolfree(m.slots, m.sizeslots * sizeof(char *));
+  toolfree(m.sizes, m.sizeslots * sizeof(size_t));
+  toolfree(m.freeslots, m.sizeslots * sizeof(size_t));
+  toolfree(ops, REPLAY_BATCH * sizeof(lmp_ReplayOp));
+  return 0;
+}
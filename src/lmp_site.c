@@ -0,0 +1,342 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** See lmp_site.h for module overview
+**
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <lua.h>
+
+#include "lmp_site.h"
+#include "lmp_struct.h"
+
+#define SITES_MINSIZE 64  /* initial number of sites (and of hash slots) */
+#define SHADOW_MINSIZE 64  /* initial number of shadow stack frames */
+#define SHADOW_SCAN 16  /* frames checked for a stale CallInfo on a call */
+
+/* one frame of the shadow stack */
+typedef struct lmp_frame {
+  const void *ci;      /* CallInfo of the frame (identifies the frame) */
+  const char *source;  /* function of the frame */
+  int linedefined;
+  int line;
+} lmp_Frame;
+
+struct lmp_sites {
+  lmp_Site *site;      /* sites by id */
+  unsigned int nsites;
+  unsigned int size;   /* allocated sites */
+  unsigned int *slot;  /* hash table of site ids (0 = empty) */
+  unsigned int nslots; /* power of 2, at least twice nsites */
+  lmp_Frame *shadow;   /* shadow stack (hook mode), innermost frame last */
+  int ntop;            /* number of frames in the shadow stack */
+  int nshadow;         /* allocated frames */
+  unsigned int cursite;  /* site of the shadow stack, if not dirty */
+  int dirty;
+};
+
+
+static unsigned int hashframe (unsigned int parent, const void *source,
+                                        int linedefined, int line) {
+  uintptr_t k = (uintptr_t) source >> 3;
+  k = k * 31 + (unsigned int) linedefined;
+  k = k * 31 + (unsigned int) line;
+  k = k * 31 + parent;
+  return (unsigned int) ((k * 0x9E3779B1UL) >> 7);
+}
+
+/* doubles the site array and the hash table (all ids are rehashed) */
+static void grow (lmp_Sites *s) {
+  unsigned int i, size = s->size * 2;
+  lmp_Site *site = (lmp_Site *) st_rawalloc(size * sizeof(lmp_Site));
+  memcpy(site, s->site, s->nsites * sizeof(lmp_Site));
+  st_rawfree(s->site, s->size * sizeof(lmp_Site));
+  st_rawfree(s->slot, s->nslots * sizeof(unsigned int));
+  s->site = site;
+  s->size = size;
+  s->nslots = size * 2;
+  s->slot = (unsigned int *) st_rawalloc(s->nslots * sizeof(unsigned int));
+  for (i = 1; i < s->nsites; i++) {
+    lmp_Site *p = &s->site[i];
+    unsigned int h = hashframe(p->parent, p->source, p->linedefined, p->line);
+    while (s->slot[h & (s->nslots - 1)] != 0)
+      h++;
+    s->slot[h & (s->nslots - 1)] = i;
+  }
+}
+
+/*
+** writes in 'out' (LUA_IDSIZE bytes) a printable name of a source, like
+** lua_Debug.short_src: the file name ("@"), the name ("=") or the
+** beginning of the string.
+*/
+static void chunkname (char *out, const char *source) {
+  size_t l = strlen(source);
+  if (*source == '@' || *source == '=') {
+    if (l <= LUA_IDSIZE - 1) {
+      strcpy(out, source + 1);
+    } else if (*source == '@') {  /* keep the end of long file names */
+      strcpy(out, "...");
+      strcat(out, source + l - (LUA_IDSIZE - 4));
+    } else {
+      memcpy(out, source + 1, LUA_IDSIZE - 1);
+      out[LUA_IDSIZE - 1] = '\0';
+    }
+  } else {
+    const char *nl = strchr(source, '\n');
+    size_t n = nl ? (size_t) (nl - source) : l;
+    if (n > LUA_IDSIZE - 15)
+      n = LUA_IDSIZE - 15;
+    strcpy(out, "[string \"");
+    strncat(out, source, n);
+    strcat(out, (n < l) ? "...\"]" : "\"]");
+  }
+}
+
+/* returns the child of 'parent' for a frame, creating it if needed */
+static unsigned int findchild (lmp_Sites *s, unsigned int parent,
+                      const char *source, int linedefined, int line) {
+  lmp_Site *p;
+  unsigned int id;
+  unsigned int h = hashframe(parent, source, linedefined, line);
+  while ((id = s->slot[h & (s->nslots - 1)]) != 0) {
+    p = &s->site[id];
+    if (p->parent == parent && p->source == source &&
+        p->linedefined == linedefined && p->line == line)
+      return id;
+    h++;
+  }
+
+  /* new site: the slot found above stays valid unless the table grows */
+  if (s->nsites == s->size) {
+    grow(s);
+    h = hashframe(parent, source, linedefined, line);
+    while (s->slot[h & (s->nslots - 1)] != 0)
+      h++;
+  }
+  id = s->nsites++;
+  s->slot[h & (s->nslots - 1)] = id;
+  p = &s->site[id];
+  p->parent = parent;
+  p->source = source;
+  p->linedefined = linedefined;
+  p->line = line;
+  chunkname(p->where, source);
+  if (line > 0)
+    sprintf(p->where + strlen(p->where), ":%d", line);
+  return id;
+}
+
+/*
+** appends a site named 'where' (a trace site record). It has no function
+** (source is NULL), so findchild never returns it.
+*/
+unsigned int si_define (lmp_Sites *s, unsigned int parent,
+                                      const char *where) {
+  lmp_Site *p;
+  unsigned int id;
+  if (s->nsites == s->size)
+    grow(s);
+  id = s->nsites++;
+  p = &s->site[id];
+  p->parent = parent;
+  p->source = NULL;
+  p->linedefined = -1;
+  p->line = -1;
+  strncpy(p->where, where, sizeof(p->where) - 1);
+  return id;
+}
+
+/* pushes a frame in the shadow stack */
+static void push (lmp_Sites *s, lua_Debug *ar) {
+  lmp_Frame *f;
+  if (s->ntop == s->nshadow) {
+    int n = s->nshadow * 2;
+    lmp_Frame *shadow = (lmp_Frame *) st_rawalloc(n * sizeof(lmp_Frame));
+    memcpy(shadow, s->shadow, s->ntop * sizeof(lmp_Frame));
+    st_rawfree(s->shadow, s->nshadow * sizeof(lmp_Frame));
+    s->shadow = shadow;
+    s->nshadow = n;
+  }
+  f = &s->shadow[s->ntop++];
+  f->ci = ar->i_ci;
+  f->source = ar->source;
+  f->linedefined = ar->linedefined;
+  f->line = ar->currentline;
+}
+
+/*
+** pops the frames above the frame 'ci' and returns 1 if it is in the
+** shadow stack. Frames unwound by errors (lua_error, coroutine yields)
+** have no return event; they are removed here, on the next event of one
+** of their callers.
+*/
+static int sync (lmp_Sites *s, const void *ci) {
+  int i;
+  for (i = s->ntop - 1; i >= 0; i--) {
+    if (s->shadow[i].ci == ci) {
+      s->ntop = i + 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+lmp_Sites *si_new (void) {
+  lmp_Sites *s = (lmp_Sites *) st_rawalloc(sizeof(lmp_Sites));
+  s->size = SITES_MINSIZE;
+  s->site = (lmp_Site *) st_rawalloc(s->size * sizeof(lmp_Site));
+  s->nslots = s->size * 2;
+  s->slot = (unsigned int *) st_rawalloc(s->nslots * sizeof(unsigned int));
+  s->nsites = 1;  /* LMP_NOSITE, zeroed */
+  s->nshadow = SHADOW_MINSIZE;
+  s->shadow = (lmp_Frame *) st_rawalloc(s->nshadow * sizeof(lmp_Frame));
+  return s;
+}
+
+void si_destroy (lmp_Sites *s) {
+  st_rawfree(s->site, s->size * sizeof(lmp_Site));
+  st_rawfree(s->slot, s->nslots * sizeof(unsigned int));
+  st_rawfree(s->shadow, s->nshadow * sizeof(lmp_Frame));
+  st_rawfree(s, sizeof(lmp_Sites));
+}
+
+/*
+** 'S' and 'l' only read the CallInfo and the Proto of each frame, so
+** lua_getinfo can be called from inside the allocation function.
+*/
+unsigned int si_capture (lmp_Sites *s, lua_State *L, int depth) {
+  lua_Debug ar;
+  unsigned int id = LMP_NOSITE;
+  int level;
+  for (level = 0; level < depth && lua_getstack(L, level, &ar); level++) {
+    lua_getinfo(L, "Sl", &ar);
+    id = findchild(s, id, ar.source, ar.linedefined, ar.currentline);
+  }
+  return id;
+}
+
+void si_initshadow (lmp_Sites *s, lua_State *L) {
+  lua_Debug ar;
+  int level = 0;
+  while (lua_getstack(L, level, &ar))
+    level++;
+  s->ntop = 0;
+  while (--level >= 0) {  /* outermost frame first */
+    lua_getstack(L, level, &ar);
+    lua_getinfo(L, "Sl", &ar);
+    push(s, &ar);
+  }
+  s->dirty = 1;
+}
+
+void si_hookevent (lmp_Sites *s, lua_State *L, lua_Debug *ar) {
+  switch (ar->event) {
+    case LUA_HOOKCALL: {
+      /*
+      ** Lua reuses the CallInfo of a depth, so a new frame with the
+      ** CallInfo of a frame in the shadow stack means that frame (and the
+      ** ones above it) was unwound. Only the top frames are checked, a
+      ** longer unwind is fixed by the next return or line event.
+      */
+      int i;
+      for (i = s->ntop - 1; i >= 0 && i >= s->ntop - SHADOW_SCAN; i--) {
+        if (s->shadow[i].ci == ar->i_ci) {
+          s->ntop = i;
+          break;
+        }
+      }
+      lua_getinfo(L, "S", ar);
+      ar->currentline = -1;  /* set by the first line event */
+      push(s, ar);
+      break;
+    }
+    case LUA_HOOKTAILCALL:
+      /* the function will run in the frame of its caller (the top one) */
+      lua_getinfo(L, "S", ar);
+      if (s->ntop > 0) {
+        lmp_Frame *f = &s->shadow[s->ntop - 1];
+        f->source = ar->source;
+        f->linedefined = ar->linedefined;
+        f->line = -1;
+      }
+      break;
+    case LUA_HOOKRET:
+      if (sync(s, ar->i_ci))
+        s->ntop--;
+      break;
+    case LUA_HOOKLINE:
+      if (sync(s, ar->i_ci)) {
+        s->shadow[s->ntop - 1].line = ar->currentline;
+      } else {  /* frame entered while the hook was not installed */
+        lua_getinfo(L, "S", ar);
+        push(s, ar);
+      }
+      break;
+    default:
+      return;
+  }
+  s->dirty = 1;
+}
+
+/* the site is computed only on the first malloc after a change */
+unsigned int si_current (lmp_Sites *s, int depth) {
+  if (s->dirty) {
+    unsigned int id = LMP_NOSITE;
+    int i;
+    for (i = s->ntop - 1; i >= 0 && i >= s->ntop - depth; i--) {
+      lmp_Frame *f = &s->shadow[i];
+      id = findchild(s, id, f->source, f->linedefined, f->line);
+    }
+    s->cursite = id;
+    s->dirty = 0;
+  }
+  return s->cursite;
+}
+
+unsigned int si_count (lmp_Sites *s) {
+  return s->nsites;
+}
+
+lmp_Site *si_get (lmp_Sites *s, unsigned int id) {
+  return &s->site[id];
+}
+
+void si_print (lmp_Sites *s, unsigned int id) {
+  if (id == LMP_NOSITE) {
+    printf("?");
+    return;
+  }
+  if (s->site[id].parent != LMP_NOSITE) {  /* inner frames first */
+    si_print(s, s->site[id].parent);
+    printf(" < ");
+  }
+  printf("%s", s->site[id].where);
+}
+
+/* appends 'str' to 'buf', which has 'size' bytes and is not full */
+static void append (char *buf, size_t size, const char *str) {
+  size_t l = strlen(buf);
+  strncat(buf, str, size - 1 - l);
+}
+
+void si_tostring (lmp_Sites *s, unsigned int id, char *buf, size_t size) {
+  unsigned int path[LMP_SITE_MAXDEPTH];
+  int n = 0;
+  buf[0] = '\0';
+  if (id == LMP_NOSITE) {
+    append(buf, size, "?");
+    return;
+  }
+  for (; id != LMP_NOSITE && n < LMP_SITE_MAXDEPTH; id = s->site[id].parent)
+    path[n++] = id;
+  while (n-- > 0) {  /* inner frames first */
+    append(buf, size, s->site[path[n]].where);
+    if (n > 0)
+      append(buf, size, " < ");
+  }
+}
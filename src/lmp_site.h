@@ -0,0 +1,119 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** This module is responsible by the allocation sites. A site is a call
+** stack (the innermost frames of the lua_State when a block was allocated),
+** interned in a trie of (function, line) frames: identical stacks are kept
+** once and are identified by a small integer (the site id) which is saved
+** in the blocks. The trie is rooted at the innermost frame, so the parent of
+** a site is the same stack without its outermost frame. The children of all
+** sites are found through one open addressing hash table keyed by
+** (parent, function, line).
+** Each site also keeps the counters of the blocks allocated there.
+** The stack can be walked on each malloc (si_capture) or kept in a shadow
+** stack updated by call, return and line hooks (si_hookevent), so the site
+** of a malloc is read without calling the debug API (si_current).
+**
+*/
+
+#ifndef LMP_LMPSITE_H
+#define LMP_LMPSITE_H
+
+#include <lua.h>
+
+/* default number of frames of a site */
+#define LMP_SITE_DEPTH 8
+#define LMP_SITE_MAXDEPTH 64
+
+/* site 0 is the empty stack (allocations done outside any function) */
+#define LMP_NOSITE 0
+
+/*
+** One node of the trie: its frame, its parent and the counters of the
+** blocks allocated with exactly this stack.
+*/
+typedef struct lmp_site {
+  unsigned int parent;  /* stack without this (outermost) frame */
+  const void *source;   /* function of the frame (source and linedefined) */
+  int linedefined;
+  int line;             /* current line of the frame (-1 if unknown) */
+  char where[LUA_IDSIZE + 12];  /* "short_src:line" */
+  long nallocs;         /* number of mallocs */
+  long allocsize;       /* bytes allocated by mallocs and reallocs */
+  long live;            /* blocks alive */
+  long livesize;        /* bytes alive */
+  long peaklive;        /* blocks alive at the peak (option peak) */
+  long peaklivesize;    /* bytes alive at the peak */
+  unsigned long peakstamp;  /* last peak epoch it changed in (see lmp.c) */
+  long grows;           /* growing reallocs of its blocks (option reallocs) */
+  long copysize;        /* bytes copied by the reallocs that moved them */
+} lmp_Site;
+
+typedef struct lmp_sites lmp_Sites;
+
+/*
+** Creates an empty trie (only site LMP_NOSITE).
+*/
+lmp_Sites *si_new (void);
+
+/*
+** Frees the trie and all sites.
+*/
+void si_destroy (lmp_Sites *s);
+
+/*
+** Walks the 'depth' innermost frames of 'L' (lua_getstack/lua_getinfo) and
+** returns the id of its site, creating it if needed. Does not allocate
+** memory in the lua_State.
+*/
+unsigned int si_capture (lmp_Sites *s, lua_State *L, int depth);
+
+/*
+** Defines a new site named 'where' (one frame) called from 'parent' and
+** returns its id. Used to rebuild the sites of a trace, whose ids are given
+** in order.
+*/
+unsigned int si_define (lmp_Sites *s, unsigned int parent,
+                                      const char *where);
+
+/*
+** Fills the shadow stack with the current frames of 'L'.
+*/
+void si_initshadow (lmp_Sites *s, lua_State *L);
+
+/*
+** Updates the shadow stack with a call, tail call, return or line event of
+** 'L' (the 'ar' of a lua_Hook).
+*/
+void si_hookevent (lmp_Sites *s, lua_State *L, lua_Debug *ar);
+
+/*
+** Returns the site of the 'depth' innermost frames of the shadow stack,
+** the same site si_capture would return.
+*/
+unsigned int si_current (lmp_Sites *s, int depth);
+
+/*
+** Returns the number of sites (valid ids are 0 to si_count - 1).
+*/
+unsigned int si_count (lmp_Sites *s);
+
+/*
+** Returns a site. The pointer is valid until the next si_capture.
+*/
+lmp_Site *si_get (lmp_Sites *s, unsigned int id);
+
+/*
+** Writes the frames of a site, innermost first, each one followed by its
+** caller (" < ").
+*/
+void si_print (lmp_Sites *s, unsigned int id);
+
+/*
+** Same as si_print, but writes in 'buf' (at most 'size' bytes, including
+** the terminating zero).
+*/
+void si_tostring (lmp_Sites *s, unsigned int id, char *buf, size_t size);
+
+#endif
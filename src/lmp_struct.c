@@ -10,26 +10,213 @@
 */
 
 
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS */
+
+#include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "lmp_struct.h"
 #include "lua.h"
 
-#define HASH_SIZE 23  /* empiric hash size - need more tests to confirm */
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#define HASH_LMINSIZE 6  /* log2 of the initial number of slots */
+#define HASH_STEP 32     /* minimum slots moved from the old table per op */
+#define ARENA_CHUNK 65536  /* bytes requested to the system per arena chunk */
+
+/* 2^HASH_BITS / golden ratio (Fibonacci hashing) */
+#if UINTPTR_MAX > 0xffffffffUL
+#define HASH_MULT ((uintptr_t) 0x9E3779B97F4A7C15UL)
+#define HASH_BITS 64
+#else
+#define HASH_MULT ((uintptr_t) 0x9E3779B9UL)
+#define HASH_BITS 32
+#endif
+
+
+/*
+** One table slot. The block address is kept in the slot itself, so probing
+** does not touch the blocks. A slot is empty when 'block' is NULL and is a
+** tombstone (removed entry) when 'block' is DELETED.
+*/
+typedef struct lmp_slot {
+  void *ptr;
+  lmp_Block *block;
+} lmp_Slot;
+
+typedef struct lmp_table {
+  lmp_Slot *slot;
+  size_t size;    /* number of slots (power of 2) */
+  int lsize;      /* log2(size) */
+  size_t nused;   /* live entries + tombstones */
+  size_t nlive;   /* live entries */
+} lmp_Table;
+
+static lmp_Block deleted;  /* tombstone mark (only its address is used) */
+#define DELETED (&deleted)
+
+
+/*
+** Filter lists links of a block. Only used in graphic mode, where blocks are
+** allocated as lmp_VBlock (the block is the first field, so a lmp_Block
+** pointer can be converted to its lmp_VBlock). Headless blocks are compact.
+*/
+typedef struct lmp_vblock {
+  lmp_Block block;
+  struct lmp_vblock *nexttype;
+  struct lmp_vblock *prevtype;
+  struct lmp_vblock *nextall;
+  struct lmp_vblock *prevall;
+} lmp_VBlock;
+
+#define VB(b) ((lmp_VBlock *) (b))
+
+
+/*
+** Blocks come from an arena of ARENA_CHUNK sized chunks, carved in cells of
+** 'cellsize' bytes (sizeof(lmp_Block) or sizeof(lmp_VBlock)). A released
+** block is linked into an intrusive free list (through its first word) and
+** reused by the next st_newblock. Chunks are linked so the whole arena is
+** released at once in st_destroyhash.
+*/
+typedef struct lmp_chunk {
+  struct lmp_chunk *next;
+  lmp_VBlock cell[1];  /* actually (ARENA_CHUNK - header) / cellsize cells */
+} lmp_Chunk;
+
+#define CHUNK_CELLS(h) \
+  ((ARENA_CHUNK - offsetof(lmp_Chunk, cell)) / (h)->cellsize)
+
+
+/*
+** Blocks of one profiled lua_State: the hash table (two tables while an
+** incremental rehash is in progress) and the block arena.
+*/
+struct lmp_hash {
+  lmp_Table head;     /* hashtable for all blocks */
+  lmp_Table old;      /* table being drained by the incremental rehash */
+  size_t rehashpos;   /* next 'old' slot to be moved */
+  size_t rehashleft;  /* 'old' slots not moved yet (0 = no rehash) */
+  uintptr_t minaddr, maxaddr;  /* range of addresses ever inserted */
+  lmp_Chunk *chunks;   /* arena chunks (last allocated first) */
+  size_t cellsize;     /* size of each block in the arena */
+  size_t nfreshcells;  /* cells of chunks[0] never handed out */
+  void *freecells;     /* released blocks */
+  int usegraphics;
+};
+
+
+/*
+** Fibonacci hashing: multiply the address (without the alignment bits) by
+** the golden ratio and keep the highest bits, which mix all address bits.
+*/
+static size_t hashfunc(lmp_Table *t, void *ptr) {
+  uintptr_t k = ((uintptr_t) ptr >> 3) * HASH_MULT;
+  return (size_t) (k >> (HASH_BITS - t->lsize));
+}
 
 
-/* simple hash function */
-static int hashfunc(void *ptr) {
-  return ((uintptr_t) ptr) % HASH_SIZE;
+static void newtable(lmp_Table *h, int lsize) {
+  size_t i;
+  h->lsize = lsize;
+  h->size = (size_t) 1 << lsize;
+  h->nused = 0;
+  h->nlive = 0;
+  h->slot = (lmp_Slot *) st_rawalloc(h->size * sizeof(lmp_Slot));
+  for (i = 0; i < h->size; i++) {
+    h->slot[i].ptr = NULL;
+    h->slot[i].block = NULL;
+  }
+}
+
+/* puts an address that is not in the table in the first free slot */
+static void rawinsert(lmp_Table *h, void *ptr, lmp_Block *block) {
+  size_t mask = h->size - 1;
+  size_t i = hashfunc(h, ptr);
+  while (h->slot[i].block != NULL && h->slot[i].block != DELETED)
+    i = (i + 1) & mask;
+  if (h->slot[i].block == NULL)  /* tombstones are already counted */
+    h->nused++;
+  h->slot[i].ptr = ptr;
+  h->slot[i].block = block;
+  h->nlive++;
+}
+
+/* removes and returns the block with address ptr (NULL if not found) */
+static lmp_Block *rawremove(lmp_Table *h, void *ptr) {
+  size_t mask = h->size - 1;
+  size_t i = hashfunc(h, ptr);
+  lmp_Block *b;
+  while ((b = h->slot[i].block) != NULL) {
+    if (b != DELETED && h->slot[i].ptr == ptr) {
+      h->slot[i].block = DELETED;
+      h->nlive--;
+      return b;
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
 }
 
+/*
+** Moves entries from h->old to h->head. A probe sequence never crosses an
+** empty slot, so entries are moved one whole cluster (run of non-empty slots)
+** at a time: clusters still in h->old stay intact and searchable. The walk
+** starts right after an empty slot, so no cluster is split at the beginning.
+*/
+static void rehashstep(lmp_Hash *h, size_t nslots) {
+  size_t mask = h->old.size - 1;
+  size_t n = 0;
+  while (h->rehashleft > 0) {
+    lmp_Slot *s = &h->old.slot[h->rehashpos];
+    if (s->block == NULL) {  /* cluster boundary */
+      if (n >= nslots)
+        return;
+    } else {
+      if (s->block != DELETED)
+        rawinsert(&h->head, s->ptr, s->block);
+      s->block = NULL;
+    }
+    h->rehashpos = (h->rehashpos + 1) & mask;
+    h->rehashleft--;
+    n++;
+  }
+  st_rawfree(h->old.slot, h->old.size * sizeof(lmp_Slot));
+  h->old.slot = NULL;
+}
 
-/* STATIC GLOBAL VARIABLE */
-static lmp_Block **lmp_head = NULL; /* hashtable for all blocks */
-static int usegraphics;
+/*
+** Starts a rehash into a table with at least four slots per live entry
+** (tombstones are discarded). Finishes a pending rehash first, which only
+** happens if h->head gets full before h->old is drained.
+*/
+static void startrehash(lmp_Hash *h) {
+  int lsize = h->head.lsize;
+  if (h->rehashleft > 0)
+    rehashstep(h, h->old.size);
+  while (((size_t) 1 << lsize) < h->head.nlive * 4)
+    lsize++;
+
+  h->old = h->head;
+  newtable(&h->head, lsize);
+  h->rehashpos = 0;
+  while (h->old.slot[h->rehashpos].block != NULL)  /* find an empty slot */
+    h->rehashpos++;
+  h->rehashleft = h->old.size;
+}
 
 
 /* GLOBAL VARIABLES - filter lists */
-/* multiply linked lists used for type filtering. used only in graphic mode */
+/*
+** multiply linked lists used for type filtering. used only in graphic mode
+** (by the single lmp_Hash created with usegraphic set). they point to
+** lmp_VBlocks (see st_getnexttype and st_getnextall).
+*/
 lmp_Block *lmp_string = NULL;
 lmp_Block *lmp_function = NULL;
 lmp_Block *lmp_userdata = NULL;
@@ -39,28 +226,52 @@ lmp_Block *lmp_other = NULL;
 lmp_Block *lmp_all = NULL; /* used to redraw all blocks */
 
 
-void st_newhash(int usegraphic) {
-  int i;
-  usegraphics = usegraphic;
-  lmp_head = (lmp_Block **) malloc (HASH_SIZE * sizeof(lmp_Block*));
-  for (i = 0; i < HASH_SIZE; i++) {
-    lmp_head[i] = NULL;
+/* returns the head of the filter list of the specified type */
+static lmp_Block **gettypelist(size_t luatype) {
+  switch (luatype) {
+    case LUA_TSTRING:
+      return &lmp_string;
+    case LUA_TFUNCTION:
+      return &lmp_function;
+    case LUA_TUSERDATA:
+      return &lmp_userdata;
+    case LUA_TTHREAD:
+      return &lmp_thread;
+    case LUA_TTABLE:
+      return &lmp_table;
+    default:  /* OTHER */
+      return &lmp_other;
   }
 }
 
-void st_destroyhash() {
-  int i;
 
-  for(i = 0; i < HASH_SIZE; i++) {
-    lmp_Block *p;
-    lmp_Block *head = lmp_head[i];
-    while (head != NULL) {
-      p = head;
-      head = head->next;
-      free(p);
-    }
+lmp_Hash *st_newhash(int usegraphic) {
+  lmp_Hash *h = (lmp_Hash *) st_rawalloc(sizeof(lmp_Hash));
+  h->usegraphics = usegraphic;
+  h->cellsize = usegraphic ? sizeof(lmp_VBlock) : sizeof(lmp_Block);
+  newtable(&h->head, HASH_LMINSIZE);
+  h->old.slot = NULL;
+  h->rehashleft = 0;
+  h->minaddr = UINTPTR_MAX;
+  h->maxaddr = 0;
+  h->chunks = NULL;
+  h->nfreshcells = 0;
+  h->freecells = NULL;
+  return h;
+}
+
+void st_destroyhash(lmp_Hash *h) {
+  int usegraphics = h->usegraphics;
+  if (h->old.slot != NULL)
+    st_rawfree(h->old.slot, h->old.size * sizeof(lmp_Slot));
+  st_rawfree(h->head.slot, h->head.size * sizeof(lmp_Slot));
+
+  while (h->chunks != NULL) {  /* blocks are released with their chunks */
+    lmp_Chunk *c = h->chunks;
+    h->chunks = c->next;
+    st_rawfree(c, ARENA_CHUNK);
   }
-  free(lmp_head);
+  st_rawfree(h, sizeof(lmp_Hash));
 
   if (usegraphics) {
     lmp_string = NULL;
@@ -73,94 +284,158 @@ void st_destroyhash() {
   }
 }
 
-lmp_Block *st_removeblock (void *ptr) {
-  lmp_Block *p, *ant = NULL;
-  int i = hashfunc(ptr);
-  for (p = lmp_head[i]; p != NULL; ant = p, p = p->next) {
-    if (p->ptr == ptr) {
-      if (ant == NULL) {
-        lmp_head[i] = p->next;
-      } else {
-        ant->next = p->next;
-      }
-      p->next = NULL;
-
-      if (usegraphics) {
-        if (p->prevtype != NULL) {
-          p->prevtype->nexttype = p->nexttype;
-        }
-        if (p->nexttype != NULL) {
-          p->nexttype->prevtype = p->prevtype;
-        }
-
-        if (p->prevall != NULL) {
-          p->prevall->nextall = p->nextall;
-        }
-        if (p->nextall != NULL) {
-          p->nextall->prevall = p->prevall;
-        }
-      }
-
-      return p;
+lmp_Block *st_removeblock (lmp_Hash *h, void *ptr) {
+  lmp_Block *p;
+
+  /* fail fast: address was never tracked (e.g. allocated before start) */
+  if ((uintptr_t) ptr < h->minaddr || (uintptr_t) ptr > h->maxaddr)
+    return NULL;
+
+  if (h->rehashleft > 0)
+    rehashstep(h, HASH_STEP);
+  p = rawremove(&h->head, ptr);
+  if (p == NULL && h->rehashleft > 0)
+    p = rawremove(&h->old, ptr);
+  if (p == NULL)
+    return NULL;
+
+  if (h->usegraphics) {
+    lmp_VBlock *v = VB(p);
+    lmp_Block **type = gettypelist(p->luatype);
+    if (v->prevtype != NULL) {
+      v->prevtype->nexttype = v->nexttype;
+    } else if (*type == p) {  /* first block of the list */
+      *type = (lmp_Block *) v->nexttype;
+    }
+    if (v->nexttype != NULL) {
+      v->nexttype->prevtype = v->prevtype;
     }
-  }
-  return NULL;
-}
 
-void st_insertblock (lmp_Block *block) {
-  lmp_Block **type;
+    if (v->prevall != NULL) {
+      v->prevall->nextall = v->nextall;
+    } else if (lmp_all == p) {
+      lmp_all = (lmp_Block *) v->nextall;
+    }
+    if (v->nextall != NULL) {
+      v->nextall->prevall = v->prevall;
+    }
+  }
 
-  int i = hashfunc(block->ptr);
-  block->next = lmp_head[i];
-  lmp_head[i] = block;
+  return p;
+}
 
-  if (usegraphics) {
-    switch (block->luatype) {
-      case LUA_TSTRING:
-        type = &lmp_string;
-        break;
-      case LUA_TFUNCTION:
-        type = &lmp_function;
-        break;
-      case LUA_TUSERDATA:
-        type = &lmp_userdata;
-        break;
-      case LUA_TTHREAD:
-        type = &lmp_thread;
-        break;
-      case LUA_TTABLE:
-        type = &lmp_table;
-        break;
-      default:  /* OTHER */
-        type = &lmp_other;
-        break;
-    }
+void st_insertblock (lmp_Hash *h, lmp_Block *block) {
+  if (h->rehashleft > 0)
+    rehashstep(h, HASH_STEP);
+  if ((h->head.nused + 1) * 2 > h->head.size)  /* keep load factor <= 1/2 */
+    startrehash(h);
+  rawinsert(&h->head, block->ptr, block);
+  if ((uintptr_t) block->ptr < h->minaddr)
+    h->minaddr = (uintptr_t) block->ptr;
+  if ((uintptr_t) block->ptr > h->maxaddr)
+    h->maxaddr = (uintptr_t) block->ptr;
+
+  if (h->usegraphics) {
+    lmp_VBlock *v = VB(block);
+    lmp_Block **type = gettypelist(block->luatype);
     if (*type != NULL) {
-      (*type)->prevtype = block;
+      VB(*type)->prevtype = v;
     }
-    block->nexttype = *type;
-    block->prevtype = NULL;
+    v->nexttype = VB(*type);
+    v->prevtype = NULL;
     *type = block;
 
     if (lmp_all != NULL) {
-      lmp_all->prevall = block;
+      VB(lmp_all)->prevall = v;
     }
-    block->nextall = lmp_all;
-    block->prevall = NULL;
+    v->nextall = VB(lmp_all);
+    v->prevall = NULL;
     lmp_all = block;
   }
 }
 
-void st_initblock (lmp_Block *block, void *ptr, size_t size, size_t luatype) {
+lmp_Block *st_newblock (lmp_Hash *h) {
+  void *c = h->freecells;
+  if (c != NULL) {
+    h->freecells = *(void **) c;
+    return (lmp_Block *) c;
+  }
+  if (h->nfreshcells == 0) {  /* current chunk is full */
+    lmp_Chunk *chunk = (lmp_Chunk *) st_rawalloc(ARENA_CHUNK);
+    chunk->next = h->chunks;
+    h->chunks = chunk;
+    h->nfreshcells = CHUNK_CELLS(h);
+  }
+  h->nfreshcells--;
+  c = (char *) h->chunks->cell + h->nfreshcells * h->cellsize;
+  return (lmp_Block *) c;
+}
+
+void st_freeblock (lmp_Hash *h, lmp_Block *block) {
+  *(void **) block = h->freecells;
+  h->freecells = block;
+}
+
+void *st_rawalloc (size_t size) {
+#if defined(MAP_ANONYMOUS)
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("luamemprofiler internal error: lmp_struct -> out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+#else
+  void *p = calloc(1, size);
+  if (p == NULL) {
+    printf("luamemprofiler internal error: lmp_struct -> out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+#endif
+}
+
+void st_rawfree (void *p, size_t size) {
+#if defined(MAP_ANONYMOUS)
+  munmap(p, size);
+#else
+  (void) size;
+  free(p);
+#endif
+}
+
+/* moved entries are cleared in the old table, so each block is seen once */
+static void rawtraverse (lmp_Table *t, void (*f)(lmp_Block *, void *),
+                                                           void *ud) {
+  size_t i;
+  for (i = 0; i < t->size; i++) {
+    lmp_Block *b = t->slot[i].block;
+    if (b != NULL && b != DELETED)
+      f(b, ud);
+  }
+}
+
+void st_traverse (lmp_Hash *h, void (*f)(lmp_Block *block, void *ud),
+                                                            void *ud) {
+  rawtraverse(&h->head, f, ud);
+  if (h->rehashleft > 0)
+    rawtraverse(&h->old, f, ud);
+}
+
+void st_initblock (lmp_Hash *h, lmp_Block *block, void *ptr, size_t size,
+                                                            size_t luatype) {
   block->ptr = ptr;
   block->size = size;
-  block->luatype = luatype;
-  block->next = NULL;
-  if (usegraphics) {
-    block->nexttype = NULL;
-    block->prevtype = NULL;
-    block->nextall = NULL;
-    block->prevall = NULL;
+  block->birth = 0;
+  block->site = 0;
+  block->resizes = 0;
+  block->luatype = (unsigned short) (luatype < ST_MAXTYPE ? luatype
+                                                          : ST_MAXTYPE);
+  if (h->usegraphics) {
+    VB(block)->nexttype = NULL;
+    VB(block)->prevtype = NULL;
+    VB(block)->nextall = NULL;
+    VB(block)->prevall = NULL;
   }
 }
 
@@ -176,24 +451,32 @@ size_t st_getluatype(lmp_Block *block) {
   return block->luatype;
 }
 
-lmp_Block *st_getnext(lmp_Block *block) {
-  return block->next;
+unsigned long st_getbirth(lmp_Block *block) {
+  return block->birth;
+}
+
+unsigned int st_getsite(lmp_Block *block) {
+  return block->site;
+}
+
+unsigned int st_getresizes(lmp_Block *block) {
+  return block->resizes;
 }
 
 lmp_Block *st_getnexttype(lmp_Block *block) {
-  return usegraphics ? block->nexttype : NULL;
+  return (lmp_Block *) VB(block)->nexttype;
 }
 
 lmp_Block *st_getprevtype(lmp_Block *block) {
-  return usegraphics ? block->prevtype : NULL;
+  return (lmp_Block *) VB(block)->prevtype;
 }
 
 lmp_Block *st_getnextall(lmp_Block *block) {
-  return usegraphics ? block->nextall : NULL;
+  return (lmp_Block *) VB(block)->nextall;
 }
 
 lmp_Block *st_getprevall(lmp_Block *block) {
-  return usegraphics ? block->prevall : NULL;
+  return (lmp_Block *) VB(block)->prevall;
 }
 
 void st_setsize(lmp_Block *block, size_t size) {
@@ -204,3 +487,16 @@ void st_setptr(lmp_Block *block, void *ptr) {
   block->ptr = ptr;
 }
 
+void st_setbirth(lmp_Block *block, unsigned long birth) {
+  block->birth = birth;
+}
+
+void st_setsite(lmp_Block *block, unsigned int site) {
+  block->site = site;
+}
+
+void st_setresizes(lmp_Block *block, unsigned int resizes) {
+  block->resizes = (unsigned short) (resizes < ST_MAXRESIZES ? resizes
+                                                             : ST_MAXRESIZES);
+}
+
@@ -7,10 +7,15 @@
 **
 ** This module is responsible by defining the block structure used keep
 ** information of each allocation and by implementing data structures to
-** hold these blocks. The main data structure is a hash table with predefined
-** size and separate chaining with list heads. There are other seven multiply
-** linked lists used for type filtering. However these lists are used just in
-** the graphic module and do not produce overhead when graphics are disabled.
+** hold these blocks. The main data structure is an open addressing hash table
+** (linear probing) keyed by the block address. The table grows on demand and
+** is rehashed incrementally: entries are moved a few slots at a time on each
+** insert/remove, so no single memory operation pays for a full resize.
+** There are other seven multiply linked lists used for type filtering.
+** However these lists are used just in the graphic module and do not
+** produce overhead when graphics are disabled.
+** Blocks and hash table memory are taken directly from the system (mmap when
+** available) so the profiler does not change the heap layout it observes.
 ** 
 */
 
@@ -23,61 +28,109 @@
 
 
 /*
-** Holds memory address, size and type of each block allocated.
+** Holds memory address, size, type, birth (allocation clock of the profiler
+** when it was allocated), allocation site (see lmp_site.h) and number of
+** reallocs (saturated at ST_MAXRESIZES) of each block allocated. The type
+** and the reallocs share one word, so the record stays 4 words long; types
+** that do not fit (not Lua tags) are kept as ST_MAXTYPE, an unknown type.
 ** Can have connection with 3 structures (hash table, type list and all list).
-** The hash table is the module main structure, the 'type list' is the list
-** where all blocks of a specific types are linked. The 'all list' is a list
-** where all blocks are sequentially linked.
+** The hash table is the module main structure and keeps pointers to blocks,
+** the 'type list' is the list where all blocks of a specific types are
+** linked. The 'all list' is a list where all blocks are sequentially linked.
+** The list links are kept out of this compact record (see lmp_struct.c) and
+** exist only in graphic mode; use the st_getnext* functions to follow them.
 */
 struct lmp_block {
   void *ptr;
   size_t size;
-  size_t luatype;
-  struct lmp_block *next;
-  struct lmp_block *nexttype;
-  struct lmp_block *prevtype;
-  struct lmp_block *nextall;
-  struct lmp_block *prevall;
+  unsigned long birth;
+  unsigned short luatype;
+  unsigned short resizes;
+  unsigned int site;
 };
 typedef struct lmp_block lmp_Block;
 
+#define ST_MAXTYPE 0xFFFF
+#define ST_MAXRESIZES 0xFFFF
 
 /*
-** Sets global usegraphics, malloc and initialize the hash table.
+** Blocks (hash table and block arena) of one profiled lua_State.
 */
-void st_newhash(int usegraphic);
+typedef struct lmp_hash lmp_Hash;
+
+
+/*
+** Creates and initializes a hash table. Only one hash table at a time may be
+** created with usegraphic set, since it owns the global filter lists.
+*/
+lmp_Hash *st_newhash(int usegraphic);
+
+/*
+** Destroy and free the hash table and all blocks (released in O(chunks)) and
+** if usegraphics reset filter lists.
+*/
+void st_destroyhash(lmp_Hash *h);
+
+/*
+** Returns an uninitialized block from the block arena.
+*/
+lmp_Block *st_newblock (lmp_Hash *h);
+
+/*
+** Gives a block (already removed from the hash table) back to the arena.
+*/
+void st_freeblock (lmp_Hash *h, lmp_Block *block);
 
 /*
-** Destroy and free the hash table and if usegraphics reset filter lists.
+** Gets/releases zeroed memory directly from the system, bypassing malloc.
+** Used for the profiler internal structures. Aborts if there is no memory.
 */
-void st_destroyhash();
+void *st_rawalloc (size_t size);
+void st_rawfree (void *p, size_t size);
 
 /*
 ** Searches for a block with specified ptr address. If the block is found,
-** removes the block from the hash table. If usegraghics, also removes
-** the block from his specific 'filter list' and from 'all list'.
+** removes the block from the hash table. Addresses that were never inserted
+** (e.g. blocks allocated before lmp_start) are rejected without probing only
+** when they fall outside the lowest to highest address ever inserted; inside
+** that range they probe like any other address and are not found. If
+** usegraphics, also removes the block from his specific 'filter list' and
+** from 'all list'.
 */
-lmp_Block *st_removeblock (void *ptr);
+lmp_Block *st_removeblock (lmp_Hash *h, void *ptr);
 
 /*
-** Inserts the specified block into the hash table. If usegraphics, also
+** Inserts the specified block into the hash table. The block address must not
+** be in the table already. If usegraphics, also
 ** inserts the block into his specific 'filter list' and into 'all list'.
 */
-void st_insertblock (lmp_Block *block);
+void st_insertblock (lmp_Hash *h, lmp_Block *block);
+
+/*
+** Calls f(block, ud) for each block in the hash table, in no particular
+** order. 'f' must not insert or remove blocks.
+*/
+void st_traverse (lmp_Hash *h, void (*f)(lmp_Block *block, void *ud),
+                                                            void *ud);
 
 /*
-** Initializes the specified block with the specified values and sets the
-** hash table pointer to NULL. If usegraphics, initialize the other pointers.
+** Initializes the specified block with the specified values (birth, site
+** and resizes are 0).
+** If usegraphics, initialize the other pointers.
 */
-void st_initblock (lmp_Block *block, void *ptr, size_t nsize, size_t luatype);
+void st_initblock (lmp_Hash *h, lmp_Block *block, void *ptr, size_t nsize,
+                                                            size_t luatype);
 
 /*
-** Gets and Sets.
+** Gets and Sets. The filter lists links (st_get*type, st_get*all) are valid
+** only in graphic mode.
 */
 void *st_getptr(lmp_Block *block);
 size_t st_getsize(lmp_Block *block);
 size_t st_getluatype(lmp_Block *block);
-lmp_Block *st_getnext(lmp_Block *block);
+unsigned long st_getbirth(lmp_Block *block);
+unsigned int st_getsite(lmp_Block *block);
+unsigned int st_getresizes(lmp_Block *block);
 lmp_Block *st_getnexttype(lmp_Block *block);
 lmp_Block *st_getprevtype(lmp_Block *block);
 lmp_Block *st_getnextall(lmp_Block *block);
@@ -85,5 +138,8 @@ lmp_Block *st_getprevall(lmp_Block *block);
 
 void st_setsize(lmp_Block *block, size_t size);
 void st_setptr(lmp_Block *block, void *ptr);
+void st_setbirth(lmp_Block *block, unsigned long birth);
+void st_setsite(lmp_Block *block, unsigned int site);
+void st_setresizes(lmp_Block *block, unsigned int resizes);  /* saturates */
 
 #endif
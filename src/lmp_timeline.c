@@ -0,0 +1,145 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** See lmp_timeline.h for module overview
+**
+*/
+
+#define _POSIX_C_SOURCE 199506L  /* clock_gettime */
+
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "lmp_timeline.h"
+#include "lmp_struct.h"
+
+/* with a clock interval, the clock is read every TIMELINE_CLOCKOPS ops */
+#define TIMELINE_CLOCKOPS 64
+
+struct lmp_timeline {
+  long interval;      /* operations between points (0 with a clock) */
+  uint64_t clock;     /* nanoseconds between points (0 without a clock) */
+  long next;          /* operations of the next check */
+  uint64_t nexttime;  /* time of the next point (clock only) */
+  long peak;          /* maximum live bytes since the last point */
+  uint64_t start;
+  int npoints;
+  lmp_TimePoint points[LMP_TIMELINE_SIZE];
+  long nmarks;        /* marks added (the ring keeps the last ones) */
+  lmp_TimeMark marks[LMP_TIMELINE_MARKS];
+};
+
+
+/* monotonic clock in nanoseconds */
+static uint64_t now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+** merges each pair of points into its second one (the maximum of the pair
+** is kept) and doubles the interval
+*/
+static void downsample (lmp_Timeline *t) {
+  int i;
+  for (i = 0; i < t->npoints / 2; i++) {
+    long peak = t->points[2 * i].peak;
+    t->points[i] = t->points[2 * i + 1];
+    if (peak > t->points[i].peak)
+      t->points[i].peak = peak;
+  }
+  t->npoints = t->npoints / 2;
+  t->interval = t->interval * 2;
+  t->clock = t->clock * 2;
+}
+
+/* fills a point of the moment 'time' */
+static void setpoint (lmp_Timeline *t, lmp_TimePoint *p, uint64_t time,
+               long nops, long memoryuse, const lmp_TypeCounters *types) {
+  int i;
+  p->nops = nops;
+  p->time = (time - t->start) / 1e9;
+  p->memoryuse = memoryuse;
+  p->peak = t->peak;
+  for (i = 0; i < LMP_NTYPES; i++)
+    p->types[i] = types[i].livesize;
+}
+
+static void addpoint (lmp_Timeline *t, uint64_t time, long nops,
+                      long memoryuse, const lmp_TypeCounters *types) {
+  if (t->npoints == LMP_TIMELINE_SIZE)
+    downsample(t);
+  setpoint(t, &t->points[t->npoints++], time, nops, memoryuse, types);
+  t->peak = memoryuse;
+}
+
+lmp_Timeline *tl_new (long interval, long ms) {
+  lmp_Timeline *t = (lmp_Timeline *) st_rawalloc(sizeof(lmp_Timeline));
+  if (ms > 0) {
+    t->clock = (uint64_t) ms * 1000000;
+    t->next = TIMELINE_CLOCKOPS;
+  } else {
+    t->interval = interval > 0 ? interval : LMP_TIMELINE_INTERVAL;
+    t->next = t->interval;
+  }
+  t->start = now();
+  t->nexttime = t->start + t->clock;
+  return t;
+}
+
+void tl_destroy (lmp_Timeline *t) {
+  st_rawfree(t, sizeof(lmp_Timeline));
+}
+
+void tl_update (lmp_Timeline *t, long nops, long memoryuse,
+                                 const lmp_TypeCounters *types) {
+  uint64_t time;
+  if (memoryuse > t->peak)
+    t->peak = memoryuse;
+  if (nops < t->next)
+    return;
+  time = now();
+  if (t->clock > 0) {
+    t->next = nops + TIMELINE_CLOCKOPS;
+    if (time < t->nexttime)
+      return;
+    addpoint(t, time, nops, memoryuse, types);
+    t->nexttime = time + t->clock;
+  } else {
+    addpoint(t, time, nops, memoryuse, types);
+    t->next = nops + t->interval;
+  }
+}
+
+void tl_mark (lmp_Timeline *t, const char *label, long nops,
+                                                  long memoryuse) {
+  lmp_TimeMark *m = &t->marks[t->nmarks++ % LMP_TIMELINE_MARKS];
+  strncpy(m->label, label, LMP_TIMELINE_LABELSIZE - 1);
+  m->label[LMP_TIMELINE_LABELSIZE - 1] = '\0';
+  m->nops = nops;
+  m->time = (now() - t->start) / 1e9;
+  m->memoryuse = memoryuse;
+}
+
+int tl_points (lmp_Timeline *t, lmp_TimePoint *v, long nops,
+               long memoryuse, const lmp_TypeCounters *types) {
+  memcpy(v, t->points, t->npoints * sizeof(lmp_TimePoint));
+  setpoint(t, &v[t->npoints], now(), nops, memoryuse, types);
+  return t->npoints + 1;
+}
+
+int tl_marks (lmp_Timeline *t, lmp_TimeMark *v) {
+  long i, first = t->nmarks > LMP_TIMELINE_MARKS ?
+                  t->nmarks - LMP_TIMELINE_MARKS : 0;
+  for (i = first; i < t->nmarks; i++)
+    v[i - first] = t->marks[i % LMP_TIMELINE_MARKS];
+  return (int) (t->nmarks - first);
+}
+
+long tl_interval (lmp_Timeline *t, int *clock) {
+  *clock = t->clock > 0;
+  return t->clock > 0 ? (long) (t->clock / 1000000) : t->interval;
+}
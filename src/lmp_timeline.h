@@ -0,0 +1,70 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** This module is responsible by the memory timeline (option timeline): the
+** live bytes, in total and of each type, sampled every 'interval'
+** operations or every 'ms' milliseconds, plus labelled marks (lmp.mark).
+** The points are kept in a fixed array of LMP_TIMELINE_SIZE entries: when
+** it is full, each pair of neighbour points is merged into one and the
+** interval is doubled, so the timeline always covers the whole run with
+** LMP_TIMELINE_SIZE/2 to LMP_TIMELINE_SIZE points, whatever its length.
+** Each point also keeps the maximum live bytes since the previous point,
+** so merging never loses a peak. The marks are kept in a ring of the last
+** LMP_TIMELINE_MARKS marks.
+**
+*/
+
+#ifndef LMP_LMPTIMELINE_H
+#define LMP_LMPTIMELINE_H
+
+#include "lmp.h"
+
+/* default number of operations between two points */
+#define LMP_TIMELINE_INTERVAL 1024
+
+typedef struct lmp_timeline lmp_Timeline;
+
+
+/*
+** Creates a timeline with a point every 'interval' operations or, if
+** 'ms' > 0, every 'ms' milliseconds.
+*/
+lmp_Timeline *tl_new (long interval, long ms);
+
+void tl_destroy (lmp_Timeline *t);
+
+/*
+** Called after each memory operation with the number of operations done
+** so far and the live counters. Adds a point when the interval is over.
+*/
+void tl_update (lmp_Timeline *t, long nops, long memoryuse,
+                                 const lmp_TypeCounters *types);
+
+/*
+** Adds a mark named 'label' (truncated) at the current moment.
+*/
+void tl_mark (lmp_Timeline *t, const char *label, long nops,
+                                                  long memoryuse);
+
+/*
+** Copies the points, oldest first, followed by a point of the current
+** moment (given by the counters), and returns their number. 'v' must have
+** LMP_TIMELINE_SIZE + 1 entries.
+*/
+int tl_points (lmp_Timeline *t, lmp_TimePoint *v, long nops,
+               long memoryuse, const lmp_TypeCounters *types);
+
+/*
+** Copies the marks, oldest first, and returns their number. 'v' must have
+** LMP_TIMELINE_MARKS entries.
+*/
+int tl_marks (lmp_Timeline *t, lmp_TimeMark *v);
+
+/*
+** Returns the current distance between points, in operations or, if
+** 'clock' gets 1, in milliseconds.
+*/
+long tl_interval (lmp_Timeline *t, int *clock);
+
+#endif
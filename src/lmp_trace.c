@@ -0,0 +1,639 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** See lmp_trace.h for module overview
+**
+*/
+
+#define _POSIX_C_SOURCE 199506L  /* clock_gettime, nanosleep, pthreads */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lmp_trace.h"
+#include "lmp_struct.h"
+
+#define TRACE_RINGSIZE (1 << 22)  /* bytes of the ring (power of 2) */
+#define TRACE_MAXRECORD 64        /* largest event or keyframe record */
+#define TRACE_MAXWHERE 255        /* longer frame names are truncated */
+#define TRACE_MININDEX 64         /* initial keyframe slots of the index */
+#define TRACE_POLL 1000000        /* ns the writer sleeps when idle */
+#define TRACE_WAIT 50000          /* ns a blocked producer sleeps */
+#define TRACE_SAMPLE 16           /* LMP_TRACE_SAMPLEFULL keeps 1 of 16 */
+
+/*
+** record tags: kind in bits 0-1, malloc type or meta subtype in bits 2-4.
+** TAG_ALIGNED (bit 5) means all addresses of an event are multiples of
+** ALIGNMENT, so their deltas are written divided by it.
+*/
+#define TAG_META 3
+#define TAG_ALIGNED 0x20
+#define ALIGNMENT 16
+#define META_KEYFRAME 0
+#define META_SITE 1
+#define META_INDEX 2
+#define META_LOSSES 3
+#define TAG(kind, sub) ((kind) | ((sub) << 2))
+
+/*
+** positions of the ring shared by the producer and the writer thread:
+** each one is written by one side only (release) and read by the other
+** (acquire). Without the GCC atomic builtins a mutex orders them.
+*/
+#if defined(__GNUC__)
+#define LOAD(t, p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(t, p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD(t, p) lockedload(t, p)
+#define STORE(t, p, v) lockedstore(t, p, v)
+#endif
+
+/*
+** The memory operations are encoded by the profiled thread (the producer)
+** into a ring of TRACE_RINGSIZE bytes and written to the file by a writer
+** thread, so lmp_alloc only copies bytes: it makes no system call unless
+** the ring is full and the policy is LMP_TRACE_BLOCK. 'head' and 'tail' only
+** grow; the ring holds the bytes [tail, head).
+*/
+struct lmp_trace {
+  /* producer side */
+  size_t head;         /* bytes produced */
+  size_t cachedtail;   /* last tail read (refreshed when the ring looks full) */
+  int flags;
+  int policy;          /* LMP_TRACE_BLOCK, DROP or SAMPLEFULL */
+  long nevents;        /* events in the ring (dropped ones not counted) */
+  long dropped;        /* events lost because the ring was full */
+  long sampled;        /* events left out while sampling */
+  long skip;           /* events seen while sampling */
+  uint64_t start;      /* clock when the trace was opened */
+  uint64_t prevtime;   /* time of the previous event in the ring */
+  uint64_t prevaddr;   /* address of the previous event in the ring */
+  unsigned int nsites;
+  uint64_t *index;     /* file offsets of the keyframes */
+  size_t nindex;
+  size_t sizeindex;
+  char pad[64];        /* keeps 'tail' out of the cache line of 'head' */
+  /* writer side */
+  size_t tail;         /* bytes written to the file */
+  size_t stop;         /* set by tr_close: drain the ring and exit */
+  FILE *f;
+  unsigned char *ring;
+  pthread_t writer;
+#if !defined(__GNUC__)
+  pthread_mutex_t lock;
+#endif
+};
+
+struct lmp_tracereader {
+  FILE *f;
+  int flags;
+  long interval;       /* events between keyframes */
+  long number;         /* number of the next event */
+  uint64_t prevtime;
+  uint64_t prevaddr;
+  unsigned int nsites;
+  uint64_t *index;     /* NULL if the trace has no index */
+  size_t nindex;
+  long dropped, sampled;
+  char where[TRACE_MAXWHERE + 1];
+};
+
+
+#if !defined(__GNUC__)
+static size_t lockedload (lmp_Trace *t, size_t *p) {
+  size_t v;
+  pthread_mutex_lock(&t->lock);
+  v = *p;
+  pthread_mutex_unlock(&t->lock);
+  return v;
+}
+
+static void lockedstore (lmp_Trace *t, size_t *p, size_t v) {
+  pthread_mutex_lock(&t->lock);
+  *p = v;
+  pthread_mutex_unlock(&t->lock);
+}
+#endif
+
+/* monotonic clock in nanoseconds (clock_gettime does not enter the kernel) */
+static uint64_t now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void sleepns (long ns) {
+  struct timespec ts;
+  ts.tv_sec = 0;
+  ts.tv_nsec = ns;
+  nanosleep(&ts, NULL);
+}
+
+static unsigned char *putvarint (unsigned char *b, uint64_t v) {
+  while (v >= 0x80) {
+    *b++ = (unsigned char) (v | 0x80);
+    v >>= 7;
+  }
+  *b++ = (unsigned char) v;
+  return b;
+}
+
+/* signed values: 0, -1, 1, -2, ... are written as 0, 1, 2, 3, ... */
+static unsigned char *putsigned (unsigned char *b, uint64_t from,
+                                                   uint64_t to) {
+  if (to >= from)
+    return putvarint(b, (to - from) << 1);
+  else
+    return putvarint(b, ((from - to) << 1) - 1);
+}
+
+/* returns TAG_ALIGNED if all addresses (a, b and the previous) are aligned */
+static int aligned (lmp_Trace *t, uintptr_t a, uintptr_t b) {
+  return ((t->prevaddr | a | b) & (ALIGNMENT - 1)) == 0 ? TAG_ALIGNED : 0;
+}
+
+/* writes an address delta, divided by ALIGNMENT if the tag says so */
+static unsigned char *putaddr (unsigned char *b, int tag, uint64_t from,
+                                                          uint64_t to) {
+  if (tag & TAG_ALIGNED)
+    return putsigned(b, from / ALIGNMENT, to / ALIGNMENT);
+  return putsigned(b, from, to);
+}
+
+static void putle (unsigned char *b, uint64_t v, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    b[i] = (unsigned char) (v >> (8 * i));
+}
+
+/* bytes in the ring, as seen by the producer (never less than the real) */
+static size_t used (lmp_Trace *t) {
+  return t->head - t->cachedtail;
+}
+
+/*
+** copies a record into the ring. If it does not fit, waits for the writer
+** when 'wait' is set and returns 0 otherwise.
+*/
+static int push (lmp_Trace *t, const unsigned char *rec, size_t len,
+                                                         int wait) {
+  size_t i, n;
+  if (used(t) + len > TRACE_RINGSIZE) {
+    t->cachedtail = LOAD(t, &t->tail);
+    while (used(t) + len > TRACE_RINGSIZE) {
+      if (!wait)
+        return 0;
+      sleepns(TRACE_WAIT);
+      t->cachedtail = LOAD(t, &t->tail);
+    }
+  }
+  i = t->head & (TRACE_RINGSIZE - 1);
+  n = TRACE_RINGSIZE - i < len ? TRACE_RINGSIZE - i : len;
+  memcpy(t->ring + i, rec, n);
+  memcpy(t->ring, rec + n, len - n);
+  STORE(t, &t->head, t->head + len);
+  return 1;
+}
+
+/* writes the bytes [from, to) of the ring to the file */
+static void writering (lmp_Trace *t, size_t from, size_t to) {
+  size_t i = from & (TRACE_RINGSIZE - 1);
+  size_t n = to - from;
+  size_t first = TRACE_RINGSIZE - i < n ? TRACE_RINGSIZE - i : n;
+  fwrite(t->ring + i, 1, first, t->f);
+  fwrite(t->ring, 1, n - first, t->f);
+}
+
+/*
+** writer thread: writes everything in the ring in one batch, then sleeps
+** while the ring is empty. 'stop' is read before 'head', so once it is set
+** the head read is final and the thread exits with an empty ring.
+*/
+static void *writer (void *ud) {
+  lmp_Trace *t = (lmp_Trace *) ud;
+  for (;;) {
+    size_t stop = LOAD(t, &t->stop);
+    size_t head = LOAD(t, &t->head);
+    if (head != t->tail) {
+      writering(t, t->tail, head);
+      STORE(t, &t->tail, head);
+    } else if (stop) {
+      return NULL;
+    } else {
+      sleepns(TRACE_POLL);
+    }
+  }
+}
+
+/*
+** writes a keyframe and saves its offset in the index. With a full ring,
+** returns 0 (the event is lost and the keyframe is tried again).
+*/
+static int keyframe (lmp_Trace *t) {
+  unsigned char rec[TRACE_MAXRECORD];
+  unsigned char *b = rec;
+  uint64_t offset = TRACE_HEADERSIZE + t->head;
+  *b++ = TAG(TAG_META, META_KEYFRAME);
+  b = putvarint(b, (uint64_t) t->nevents);
+  b = putvarint(b, t->prevtime);
+  b = putvarint(b, t->prevaddr);
+  if (!push(t, rec, b - rec, t->policy == LMP_TRACE_BLOCK))
+    return 0;
+  if (t->nindex == t->sizeindex) {
+    size_t size = t->sizeindex ? t->sizeindex * 2 : TRACE_MININDEX;
+    uint64_t *index = (uint64_t *) st_rawalloc(size * sizeof(uint64_t));
+    if (t->index != NULL) {
+      memcpy(index, t->index, t->nindex * sizeof(uint64_t));
+      st_rawfree(t->index, t->sizeindex * sizeof(uint64_t));
+    }
+    t->index = index;
+    t->sizeindex = size;
+  }
+  t->index[t->nindex++] = offset;
+  return 1;
+}
+
+/*
+** decides if an event is recorded: writes the keyframe it needs and, with
+** LMP_TRACE_SAMPLEFULL and a ring more than half full, keeps one event of
+** TRACE_SAMPLE.
+*/
+static int begin (lmp_Trace *t) {
+  if (t->policy == LMP_TRACE_SAMPLEFULL &&
+      used(t) > TRACE_RINGSIZE / 2 &&
+      (t->cachedtail = LOAD(t, &t->tail), used(t) > TRACE_RINGSIZE / 2) &&
+      ++t->skip % TRACE_SAMPLE != 0) {
+    t->sampled++;
+    return 0;
+  }
+  if (t->nevents % LMP_TRACE_KEYFRAME == 0 &&
+      t->nindex == (size_t) (t->nevents / LMP_TRACE_KEYFRAME) &&
+      !keyframe(t)) {
+    t->dropped++;
+    return 0;
+  }
+  return 1;
+}
+
+/* starts an event record in 'rec' (tag and time delta) and returns its end */
+static unsigned char *newevent (lmp_Trace *t, unsigned char *rec, int tag,
+                                                         uint64_t *time) {
+  *time = now() - t->start;
+  *rec++ = (unsigned char) tag;
+  return putvarint(rec, *time - t->prevtime);
+}
+
+/* pushes an event record; the delta bases change only if it is recorded */
+static void commit (lmp_Trace *t, unsigned char *rec, unsigned char *end,
+                                        uint64_t time, uintptr_t addr) {
+  if (push(t, rec, end - rec, t->policy == LMP_TRACE_BLOCK)) {
+    t->prevtime = time;
+    t->prevaddr = addr;
+    t->nevents++;
+  } else {
+    t->dropped++;
+  }
+}
+
+lmp_Trace *tr_open (const char *path, int flags, int policy) {
+  lmp_Trace *t;
+  unsigned char header[TRACE_HEADERSIZE];
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return NULL;
+  setvbuf(f, NULL, _IONBF, 0);  /* the ring is the buffer */
+  memset(header, 0, TRACE_HEADERSIZE);
+  memcpy(header, "LMPTRACE", 8);
+  header[8] = LMP_TRACE_VERSION;
+  header[9] = (unsigned char) flags;
+  putle(header + 12, LMP_TRACE_KEYFRAME, 4);
+  fwrite(header, 1, TRACE_HEADERSIZE, f);
+  t = (lmp_Trace *) st_rawalloc(sizeof(lmp_Trace));
+  t->f = f;
+  t->flags = flags;
+  t->policy = policy;
+  t->ring = (unsigned char *) st_rawalloc(TRACE_RINGSIZE);
+  t->nsites = 1;  /* site 0 */
+  t->start = now();
+#if !defined(__GNUC__)
+  pthread_mutex_init(&t->lock, NULL);
+#endif
+  if (pthread_create(&t->writer, NULL, writer, t) != 0) {
+    fclose(f);
+    st_rawfree(t->ring, TRACE_RINGSIZE);
+    st_rawfree(t, sizeof(lmp_Trace));
+    return NULL;
+  }
+  return t;
+}
+
+void tr_close (lmp_Trace *t) {
+  /* losses, index (varints of 10 bytes at most) and trailer */
+  size_t size = 2 * TRACE_MAXRECORD + t->nindex * 10 + TRACE_TRAILERSIZE;
+  unsigned char *buf, *b;
+  uint64_t prev = 0, indexat;
+  size_t i;
+  STORE(t, &t->stop, 1);
+  pthread_join(t->writer, NULL);
+
+  /* the ring is empty: the end is encoded here and written at once */
+  buf = b = (unsigned char *) st_rawalloc(size);
+  *b++ = TAG(TAG_META, META_LOSSES);
+  b = putvarint(b, (uint64_t) t->dropped);
+  b = putvarint(b, (uint64_t) t->sampled);
+  indexat = TRACE_HEADERSIZE + t->head + (b - buf);
+  *b++ = TAG(TAG_META, META_INDEX);
+  b = putvarint(b, t->nindex);
+  for (i = 0; i < t->nindex; i++) {
+    b = putvarint(b, t->index[i] - prev);
+    prev = t->index[i];
+  }
+  putle(b, indexat, 8);
+  memcpy(b + 8, "LMPX", 4);  /* trailer */
+  b += TRACE_TRAILERSIZE;
+  fwrite(buf, 1, b - buf, t->f);
+  st_rawfree(buf, size);
+  if (ferror(t->f))
+    fprintf(stderr, "luamemprofiler: error writing the trace\n");
+  fclose(t->f);
+#if !defined(__GNUC__)
+  pthread_mutex_destroy(&t->lock);
+#endif
+  if (t->index != NULL)
+    st_rawfree(t->index, t->sizeindex * sizeof(uint64_t));
+  st_rawfree(t->ring, TRACE_RINGSIZE);
+  st_rawfree(t, sizeof(lmp_Trace));
+}
+
+void tr_malloc (lmp_Trace *t, void *p, size_t nsize, int type,
+                                                     unsigned int site) {
+  unsigned char rec[TRACE_MAXRECORD];
+  unsigned char *b;
+  uint64_t time;
+  int tag = TAG(LMP_TRACE_MALLOC, type) | aligned(t, (uintptr_t) p, 0);
+  if (!begin(t))
+    return;
+  b = newevent(t, rec, tag, &time);
+  b = putaddr(b, tag, t->prevaddr, (uintptr_t) p);
+  b = putvarint(b, nsize);
+  if (t->flags & LMP_TRACE_SITES)
+    b = putvarint(b, site);
+  commit(t, rec, b, time, (uintptr_t) p);
+}
+
+void tr_free (lmp_Trace *t, void *ptr, size_t osize) {
+  unsigned char rec[TRACE_MAXRECORD];
+  unsigned char *b;
+  uint64_t time;
+  int tag = TAG(LMP_TRACE_FREE, 0) | aligned(t, (uintptr_t) ptr, 0);
+  if (!begin(t))
+    return;
+  b = newevent(t, rec, tag, &time);
+  b = putaddr(b, tag, t->prevaddr, (uintptr_t) ptr);
+  b = putvarint(b, osize);
+  commit(t, rec, b, time, (uintptr_t) ptr);
+}
+
+void tr_realloc (lmp_Trace *t, void *ptr, void *p, size_t osize,
+                                                   size_t nsize) {
+  unsigned char rec[TRACE_MAXRECORD];
+  unsigned char *b;
+  uint64_t time;
+  int tag = TAG(LMP_TRACE_REALLOC, 0) |
+            aligned(t, (uintptr_t) ptr, (uintptr_t) p);
+  if (!begin(t))
+    return;
+  b = newevent(t, rec, tag, &time);
+  b = putaddr(b, tag, t->prevaddr, (uintptr_t) ptr);
+  b = putaddr(b, tag, (uintptr_t) ptr, (uintptr_t) p);
+  b = putvarint(b, osize);
+  b = putvarint(b, nsize);
+  commit(t, rec, b, time, (uintptr_t) p);
+}
+
+/* sites are never dropped: the mallocs that follow refer to them */
+void tr_site (lmp_Trace *t, unsigned int parent, const char *where) {
+  unsigned char rec[TRACE_MAXRECORD + TRACE_MAXWHERE];
+  unsigned char *b = rec;
+  size_t l = strlen(where);
+  if (l > TRACE_MAXWHERE)
+    l = TRACE_MAXWHERE;
+  *b++ = TAG(TAG_META, META_SITE);
+  b = putvarint(b, parent);
+  b = putvarint(b, l);
+  memcpy(b, where, l);
+  push(t, rec, b + l - rec, 1);
+  t->nsites++;
+}
+
+unsigned int tr_nsites (lmp_Trace *t) {
+  return t->nsites;
+}
+
+void tr_counts (lmp_Trace *t, long *nevents, long *dropped, long *sampled) {
+  *nevents = t->nevents;
+  *dropped = t->dropped;
+  *sampled = t->sampled;
+}
+
+
+/* reads a varint; returns 0 at the end of the file */
+static int getvarint (FILE *f, uint64_t *v) {
+  int c, shift = 0;
+  *v = 0;
+  do {
+    if ((c = getc(f)) == EOF || shift > 63)
+      return 0;
+    *v |= (uint64_t) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 1;
+}
+
+/* reads an address delta written by putaddr and adds it to 'base' */
+static int getaddr (FILE *f, int tag, uint64_t base, uint64_t *v) {
+  uint64_t z;
+  if (!getvarint(f, &z))
+    return 0;
+  z = (z & 1) ? -((z + 1) >> 1) : (z >> 1);
+  *v = base + ((tag & TAG_ALIGNED) ? z * ALIGNMENT : z);
+  return 1;
+}
+
+static uint64_t getle (const unsigned char *b, int n) {
+  uint64_t v = 0;
+  while (n-- > 0)
+    v = (v << 8) | b[n];
+  return v;
+}
+
+/* reads the index, if the trace has a trailer */
+static void readindex (lmp_TraceReader *r) {
+  unsigned char trailer[TRACE_TRAILERSIZE];
+  uint64_t n, d, offset = 0;
+  size_t i;
+  if (fseek(r->f, -TRACE_TRAILERSIZE, SEEK_END) != 0 ||
+      fread(trailer, 1, TRACE_TRAILERSIZE, r->f) != TRACE_TRAILERSIZE ||
+      memcmp(trailer + 8, "LMPX", 4) != 0 ||
+      fseek(r->f, (long) getle(trailer, 8), SEEK_SET) != 0 ||
+      getc(r->f) != TAG(TAG_META, META_INDEX) ||
+      !getvarint(r->f, &n) || n > getle(trailer, 8))
+    return;
+  r->index = (uint64_t *) st_rawalloc((n + 1) * sizeof(uint64_t));
+  for (i = 0; i < n; i++) {
+    if (!getvarint(r->f, &d)) {
+      st_rawfree(r->index, (n + 1) * sizeof(uint64_t));
+      r->index = NULL;
+      return;
+    }
+    offset += d;
+    r->index[i] = offset;
+  }
+  r->nindex = (size_t) n;
+}
+
+lmp_TraceReader *tr_openreader (const char *path, int *flags) {
+  unsigned char header[TRACE_HEADERSIZE];
+  lmp_TraceReader *r;
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return NULL;
+  if (fread(header, 1, TRACE_HEADERSIZE, f) != TRACE_HEADERSIZE ||
+      memcmp(header, "LMPTRACE", 8) != 0 ||
+      header[8] != LMP_TRACE_VERSION) {
+    fclose(f);
+    return NULL;
+  }
+  r = (lmp_TraceReader *) st_rawalloc(sizeof(lmp_TraceReader));
+  r->f = f;
+  r->flags = header[9];
+  r->interval = (long) getle(header + 12, 4);
+  r->nsites = 1;
+  readindex(r);
+  fseek(f, TRACE_HEADERSIZE, SEEK_SET);
+  if (flags != NULL)
+    *flags = r->flags;
+  return r;
+}
+
+/* reads the values of a keyframe (after its tag) */
+static int readkeyframe (lmp_TraceReader *r) {
+  uint64_t number;
+  if (!getvarint(r->f, &number) || !getvarint(r->f, &r->prevtime) ||
+      !getvarint(r->f, &r->prevaddr))
+    return 0;
+  r->number = (long) number;
+  return 1;
+}
+
+int tr_read (lmp_TraceReader *r, lmp_TraceEvent *ev) {
+  uint64_t v[4];
+  int c;
+  memset(ev, 0, sizeof(lmp_TraceEvent));
+  for (;;) {
+    if ((c = getc(r->f)) == EOF)
+      return LMP_TRACE_END;  /* trace without index */
+    if ((c & 3) != TAG_META)
+      break;
+    switch ((c >> 2) & 7) {
+      case META_KEYFRAME:
+        if (!readkeyframe(r))
+          return LMP_TRACE_ERROR;
+        break;
+      case META_SITE:
+        if (!getvarint(r->f, &v[0]) || !getvarint(r->f, &v[1]) ||
+            v[1] > TRACE_MAXWHERE ||
+            fread(r->where, 1, (size_t) v[1], r->f) != (size_t) v[1])
+          return LMP_TRACE_ERROR;
+        r->where[v[1]] = '\0';
+        ev->kind = LMP_TRACE_SITE;
+        ev->site = r->nsites++;
+        ev->parent = (unsigned int) v[0];
+        ev->where = r->where;
+        return LMP_TRACE_SITE;
+      case META_LOSSES:
+        if (!getvarint(r->f, &v[0]) || !getvarint(r->f, &v[1]))
+          return LMP_TRACE_ERROR;
+        r->dropped = (long) v[0];
+        r->sampled = (long) v[1];
+        break;
+      case META_INDEX:
+        return LMP_TRACE_END;
+      default:
+        return LMP_TRACE_ERROR;
+    }
+  }
+
+  /* event: time and address */
+  ev->kind = c & 3;
+  ev->number = r->number++;
+  if (!getvarint(r->f, &v[0]) || !getaddr(r->f, c, r->prevaddr, &v[1]))
+    return LMP_TRACE_ERROR;
+  r->prevtime += v[0];
+  ev->time = r->prevtime;
+  ev->ptr = (uintptr_t) v[1];
+  r->prevaddr = v[1];
+  switch (ev->kind) {
+    case LMP_TRACE_FREE:
+      if (!getvarint(r->f, &v[2]))
+        return LMP_TRACE_ERROR;
+      ev->osize = (size_t) v[2];
+      break;
+    case LMP_TRACE_MALLOC:
+      if (!getvarint(r->f, &v[2]) ||
+          ((r->flags & LMP_TRACE_SITES) && !getvarint(r->f, &v[3])))
+        return LMP_TRACE_ERROR;
+      ev->nsize = (size_t) v[2];
+      ev->type = (c >> 2) & 7;
+      ev->site = (r->flags & LMP_TRACE_SITES) ? (unsigned int) v[3] : 0;
+      break;
+    default:  /* LMP_TRACE_REALLOC */
+      if (!getaddr(r->f, c, v[1], &v[2]) || !getvarint(r->f, &v[0]) ||
+          !getvarint(r->f, &v[3]))
+        return LMP_TRACE_ERROR;
+      ev->nptr = (uintptr_t) v[2];
+      ev->osize = (size_t) v[0];
+      ev->nsize = (size_t) v[3];
+      r->prevaddr = v[2];
+      break;
+  }
+  return ev->kind;
+}
+
+int tr_seek (lmp_TraceReader *r, long number) {
+  lmp_TraceEvent ev;
+  size_t k;
+  int c;
+  if (r->index == NULL || r->nindex == 0 || number < 0)
+    return 0;
+  k = (size_t) (number / r->interval);
+  if (k >= r->nindex)
+    k = r->nindex - 1;
+  if (fseek(r->f, (long) r->index[k], SEEK_SET) != 0 ||
+      getc(r->f) != TAG(TAG_META, META_KEYFRAME) || !readkeyframe(r))
+    return 0;
+  while (r->number < number) {
+    if (tr_read(r, &ev) < 0)
+      return 0;
+  }
+  c = getc(r->f);  /* the losses and the index follow the last event */
+  if (c == EOF || ungetc(c, r->f) == EOF ||
+      c == TAG(TAG_META, META_LOSSES) || c == TAG(TAG_META, META_INDEX))
+    return 0;
+  return r->number == number;
+}
+
+void tr_losses (lmp_TraceReader *r, long *dropped, long *sampled) {
+  *dropped = r->dropped;
+  *sampled = r->sampled;
+}
+
+void tr_closereader (lmp_TraceReader *r) {
+  fclose(r->f);
+  if (r->index != NULL)
+    st_rawfree(r->index, (r->nindex + 1) * sizeof(uint64_t));
+  st_rawfree(r, sizeof(lmp_TraceReader));
+}
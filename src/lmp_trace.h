@@ -0,0 +1,161 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** This module is responsible by the binary trace of the memory operations
+** (option trace): every malloc, realloc and free done by the profiled
+** lua_State, in the order it did them, with its time, addresses, sizes, the
+** type of the new blocks and their allocation sites.
+** The file starts with a fixed header of TRACE_HEADERSIZE bytes:
+**   "LMPTRACE", version (1 byte), flags (1 byte, LMP_TRACE_SITES), 2 bytes
+**   reserved, number of events between keyframes (4 bytes, little endian)
+** followed by records. Each record is a tag byte (bits 0-1: kind, bits 2-4:
+** type of a malloc or meta record subtype, bit 5: addresses are multiples
+** of 16 and their deltas are divided by 16) and unsigned varints (7 bits per
+** byte, low bits first); signed values are zigzag encoded. Times are deltas
+** in nanoseconds and addresses are deltas from the previous address, so
+** operations close in time and in the heap take a few bytes:
+**   free:     dt, address delta, old size
+**   malloc:   dt, address delta, size [, site if LMP_TRACE_SITES]
+**   realloc:  dt, old address delta, new address - old address, old size,
+**             new size
+**   keyframe: event number, time, previous address
+**   site:     parent site, length, frame name (defines the next site id,
+**             from 1; site 0 is the empty stack)
+**   losses:   events dropped and left out by sampling (before the index)
+**   index:    number of keyframes, deltas of their file offsets
+** A keyframe is written before every 'keyframe interval' events with the
+** absolute values of the delta bases, so a reader can start decoding at any
+** keyframe. The file ends with the index record and a trailer of
+** TRACE_TRAILERSIZE bytes: the offset of the index (8 bytes, little endian)
+** and "LMPX". A trace cut short (e.g. by a crash) has no index, but can still
+** be read from the beginning.
+** The writer does no I/O in the profiled thread: records are copied into a
+** lock-free single producer, single consumer ring, which a writer thread
+** drains to the file in large writes. When the ring is full, the policy
+** decides: wait for the writer, drop the event or, while the ring is more
+** than half full, keep only a sample of the events. Lost events are simply
+** absent (the deltas are taken from the previous recorded event) and are
+** counted in the losses record.
+**
+*/
+
+#ifndef LMP_LMPTRACE_H
+#define LMP_LMPTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LMP_TRACE_VERSION 1
+
+/* header flags */
+#define LMP_TRACE_SITES 1  /* mallocs have their site */
+
+/* what a full ring does to new events (tr_open) */
+#define LMP_TRACE_BLOCK 0       /* waits for the writer thread */
+#define LMP_TRACE_DROP 1        /* drops them (counted) */
+#define LMP_TRACE_SAMPLEFULL 2  /* keeps 1 of 16 while half full, drops */
+
+/* events between two keyframes */
+#define LMP_TRACE_KEYFRAME 65536
+
+/* record kinds (LMP_TRACE_SITE is returned by tr_read for site records) */
+#define LMP_TRACE_FREE 0
+#define LMP_TRACE_MALLOC 1
+#define LMP_TRACE_REALLOC 2
+#define LMP_TRACE_SITE 3
+#define LMP_TRACE_END (-1)    /* end of the trace */
+#define LMP_TRACE_ERROR (-2)  /* invalid or truncated record */
+
+#define TRACE_HEADERSIZE 16
+#define TRACE_TRAILERSIZE 12
+
+typedef struct lmp_trace lmp_Trace;
+typedef struct lmp_tracereader lmp_TraceReader;
+
+/* one record read by tr_read (fields not used by a kind are zero) */
+typedef struct lmp_traceevent {
+  int kind;           /* LMP_TRACE_* */
+  long number;        /* index of the event (from 0), sites not counted */
+  uint64_t time;      /* nanoseconds since the trace started */
+  uintptr_t ptr;      /* block (old block of a realloc) */
+  uintptr_t nptr;     /* new block of a realloc */
+  size_t osize;       /* size of a freed or realloc'ed block */
+  size_t nsize;       /* size of a malloc'ed or realloc'ed block */
+  int type;           /* type index of a malloc (see lmp_gettypes) */
+  unsigned int site;  /* site of a malloc, id of a site record */
+  unsigned int parent;  /* parent of a site record */
+  const char *where;  /* frame of a site record, valid until next tr_read */
+} lmp_TraceEvent;
+
+
+/*
+** Creates (truncates) the trace file 'path', writes the header and starts
+** the writer thread. 'policy' is LMP_TRACE_BLOCK, DROP or SAMPLEFULL.
+** Returns NULL if the file cannot be opened or the thread created.
+*/
+lmp_Trace *tr_open (const char *path, int flags, int policy);
+
+/*
+** Stops the writer thread once it has written the whole ring, then writes
+** the losses, the index and the trailer and closes the file.
+*/
+void tr_close (lmp_Trace *t);
+
+/*
+** Records a memory operation: encodes it and copies it into the ring.
+** Must be called by one thread at a time (the lua_State allocations).
+*/
+void tr_malloc (lmp_Trace *t, void *p, size_t nsize, int type,
+                                                     unsigned int site);
+void tr_free (lmp_Trace *t, void *ptr, size_t osize);
+void tr_realloc (lmp_Trace *t, void *ptr, void *p, size_t osize,
+                                                   size_t nsize);
+
+/*
+** Defines the next site (ids are given in order, from 1), which is the
+** frame 'where' called from the site 'parent'. A site must be defined
+** before the first malloc that uses it.
+*/
+void tr_site (lmp_Trace *t, unsigned int parent, const char *where);
+
+/*
+** Returns the number of sites defined, including site 0.
+*/
+unsigned int tr_nsites (lmp_Trace *t);
+
+/*
+** Gets the number of events recorded, dropped and left out by sampling.
+*/
+void tr_counts (lmp_Trace *t, long *nevents, long *dropped, long *sampled);
+
+
+/*
+** Opens a trace for reading. Returns NULL if it cannot be opened or is not
+** a trace of this version. 'flags' gets the header flags.
+*/
+lmp_TraceReader *tr_openreader (const char *path, int *flags);
+
+/*
+** Reads the next record into 'ev' and returns its kind (LMP_TRACE_END at
+** the end of the trace). Keyframes and the index are handled internally.
+*/
+int tr_read (lmp_TraceReader *r, lmp_TraceEvent *ev);
+
+/*
+** Moves to the keyframe at or before the event 'number' (using the index)
+** and skips the events before it, so the next tr_read returns it. Site
+** records before that keyframe are not read again. Returns 0 if the trace
+** has no index or fewer events.
+*/
+int tr_seek (lmp_TraceReader *r, long number);
+
+/*
+** Gets the number of events lost by the writer (known at the end of the
+** trace).
+*/
+void tr_losses (lmp_TraceReader *r, long *dropped, long *sampled);
+
+void tr_closereader (lmp_TraceReader *r);
+
+#endif
@@ -7,28 +7,117 @@
 ** This module is responsible for registering the luamemprofiler lib in the
 ** Lua environment. It also sets a finalizer for the luamemprofiler library
 ** which restores the lua_State original function when the library is garbage
-** collected.
+** collected. Each lua_State gets its own profiler context (see lmp.h), so
+** several lua_States can be profiled at the same time.
 ** The library implements two main functions (start and stop).
 ** The start function receives an optional parameter (a number containing
 ** the expected memory consumption) which determines if the library will
-** display real-time information and the granularity of the blocks.
+** display real-time information and the granularity of the blocks. The
+** parameter can also be a table of options: 'memory' (same as the number),
+** 'mode' ("full", "counters" or "sample"), 'sample' (mean bytes between
+** samples), 'threadsafe' (boolean), 'detail' (boolean), 'sites' (true or
+** the number of frames of the allocation sites), 'hook' (boolean), 'leaks'
+** (boolean), 'collect' (boolean, full collection before the leak report),
+** 'output' (file of a JSON or CSV report), 'format' ("json" or "csv"),
+** 'trace' (file of the binary trace of the memory operations),
+** 'tracefull' ("block", "drop" or "sample": what to do when the trace
+** writer falls behind), 'timeline' (true or the number of operations
+** between two points of the memory timeline), 'timelinems' (or the
+** milliseconds between them), 'peak' (boolean, what was alive at the
+** peak), 'gc' (boolean, statistics of each garbage collection cycle) and
+** 'reallocs' (boolean, reallocs in place and moving, reallocs per block).
+** The cycles are found with a sentinel: an unreachable userdata whose
+** finalizer runs at the end of each cycle and creates the next sentinel.
+** The report function writes a merged report of all threadsafe lua_States
+** and returns its counters.
+** The types function returns the counters of each type of the lua_State.
+** The stats function returns the current counters in a table created by
+** start, so it does not allocate memory.
+** The snapshot function returns a handle with the live counters (total, by
+** type and by site) and the diff function compares two of them.
+** The mark function adds a labelled mark to the timeline and the timeline
+** function returns it.
 **
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <stdint.h>
 
 #include "lmp.h"
+#include "lmp_site.h"
+#include "lmp_output.h"
+#include "lmp_trace.h"
+#include "lmp_timeline.h"
 
-/* Keeps the default allocation function and the ud of a lua_State */
+/*
+** Keeps the default allocation function and the ud of a lua_State and its
+** profiler context (NULL when the profiler is stopped).
+*/
 typedef struct lmp_allocstructure {
   lua_Alloc f;
   void *ud;
+  lmp_Context *ctx;
+  int usegraphics;
+  int collect;  /* full garbage collection in lmp.stop */
 } lmp_Alloc;
 
+/* the graphical display is unique, only one lua_State may use it */
+static int graphicsinuse = 0;
+
+/* metatable of the snapshot handles */
+#define SNAPSHOT_MT "luamemprofiler_snapshot"
+
+/* metatable of the garbage collection sentinels */
+#define SENTINEL_MT "luamemprofiler_sentinel"
+
+/* size of a site name in lmp.diff */
+#define SITENAME_SIZE 1024
+
+/* a site of lmp.diff shrank (otherwise it grew) */
+#define SHRANK(d) ((d)->livesize < 0 || ((d)->livesize == 0 && (d)->live < 0))
+
+/*
+** Snapshot handle (userdata): live counters copied from the profiler
+** context, which maintains them on each memory operation.
+*/
+typedef struct lmp_snapshotud {
+  lmp_Live total;
+  lmp_Live types[LMP_NTYPES];
+  unsigned int nsites;
+  lmp_Live sites[1];  /* actually nsites */
+} lmp_SnapshotUd;
+
+/* one changed site of lmp.diff */
+typedef struct lmp_sitediff {
+  unsigned int site;
+  long live;
+  long livesize;
+} lmp_SiteDiff;
+
+/* names of the type categories, in lmp_TypeCounters order */
+static const char *const typenames[LMP_NTYPES] = {
+  "string", "function", "userdata", "thread", "table", "other"
+};
+
+/*
+** restores the original allocation function and stops the profiler. The
+** garbage collection sentinel is disarmed after that: setting the registry
+** field may allocate, and it must not be counted.
+*/
+static void stopprofiler (lua_State *L, lmp_Alloc *s) {
+  lua_setallocf(L, s->f, s->ud);
+  lua_pushnil(L);  /* disarms the garbage collection sentinel */
+  lua_setfield(L, LUA_REGISTRYINDEX, "luamemprofiler_gc");
+  lmp_stop(s->ctx);
+  s->ctx = NULL;
+  if (s->usegraphics)
+    graphicsinuse = 0;
+}
+
 /*
 ** Called when main program ends.
 ** Restores lua_State original allocation function.
@@ -44,16 +133,15 @@ static int finalize (lua_State *L) {
 
   /* get lmp_Alloc and restore original allocation function */
   s = (lmp_Alloc *) lua_touserdata(L, -1);
-  if (s->f != lua_getallocf (L, NULL)) {
-    lua_setallocf(L, s->f, s->ud);
-    lmp_stop();
+  if (s->ctx != NULL) {
+    stopprofiler(L, s);
   }
 
   return 0;
 }
 
 /* Register finalize function as metatable */
-static void create_finalizer(lua_State *L, lua_Alloc f, void *ud) {
+static lmp_Alloc *create_finalizer(lua_State *L, lua_Alloc f, void *ud) {
   lmp_Alloc *s;
 
   /* create metatable with finalize function (__gc field) */
@@ -65,37 +153,291 @@ static void create_finalizer(lua_State *L, lua_Alloc f, void *ud) {
   s = (lmp_Alloc*) lua_newuserdata(L, (size_t) sizeof(lmp_Alloc));
   s->f = f;
   s->ud = ud;
+  s->ctx = NULL;
+  s->usegraphics = 0;
+  s->collect = 0;
 
   /* set userdata metatable */
   luaL_setmetatable(L, "luamemprofiler_mt");
 
   /* insert userdata into registry table so it cannot be collected */
   lua_setfield(L, LUA_REGISTRYINDEX, "luamemprofiler_ud");
+  return s;
+}
+
+/*
+** Reads start parameter: nothing, a number (expected memory consumption) or
+** a table with the fields 'memory' (number), 'mode' (string), 'sample'
+** (number), 'threadsafe' (boolean), 'detail' (boolean), 'sites' (true or
+** number of frames), 'hook' (boolean, sites kept by hooks), 'leaks'
+** (boolean), 'collect' (boolean, returned), 'output' (string),
+** 'format' (string, by default "csv" if output ends in ".csv", else "json"),
+** 'trace' (string), 'tracefull' (string), 'timeline' (true or number),
+** 'timelinems' (number), 'peak' (boolean), 'gc' (boolean) and 'reallocs'
+** (boolean). The output and trace strings stay referenced by the table
+** while lmp_start uses them.
+*/
+static int getoptions (lua_State *L, lmp_Options *opt) {
+  int collect = 0;
+  opt->mode = LMP_MODE_FULL;
+  opt->threadsafe = 0;
+  opt->detail = 0;
+  opt->sitedepth = 0;
+  opt->sitehook = 0;
+  opt->leaks = 0;
+  opt->output = NULL;
+  opt->outputformat = LMP_OUTPUT_JSON;
+  opt->trace = NULL;
+  opt->tracepolicy = LMP_TRACE_BLOCK;
+  opt->timeline = 0;
+  opt->timelinems = 0;
+  opt->peak = 0;
+  opt->gc = 0;
+  opt->reallocs = 0;
+  opt->sampleinterval = LMP_SAMPLE_INTERVAL;
+  if (!lua_istable(L, 1)) {
+    opt->memused = (float) lua_tonumber(L, 1);
+  } else {
+    lua_getfield(L, 1, "memory");
+    opt->memused = (float) lua_tonumber(L, -1);
+    lua_getfield(L, 1, "mode");
+    if (!lua_isnil(L, -1)) {
+      const char *m = lua_tostring(L, -1);
+      if (m != NULL && strcmp(m, "full") == 0) {
+        opt->mode = LMP_MODE_FULL;
+      } else if (m != NULL && strcmp(m, "counters") == 0) {
+        opt->mode = LMP_MODE_COUNTERS;
+      } else if (m != NULL && strcmp(m, "sample") == 0) {
+        opt->mode = LMP_MODE_SAMPLE;
+      } else {
+        luaL_error(L, "invalid luamemprofiler mode '%s'", m ? m : "?");
+      }
+    }
+    lua_getfield(L, 1, "threadsafe");
+    opt->threadsafe = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "sample");
+    if (!lua_isnil(L, -1)) {
+      opt->sampleinterval = (long) lua_tonumber(L, -1);
+      if (opt->sampleinterval <= 0)
+        luaL_error(L, "luamemprofiler sample interval must be positive");
+    }
+    lua_getfield(L, 1, "detail");
+    opt->detail = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "sites");
+    if (lua_isnumber(L, -1)) {
+      opt->sitedepth = (int) lua_tonumber(L, -1);
+      if (opt->sitedepth <= 0)
+        luaL_error(L, "luamemprofiler sites depth must be positive");
+    } else if (lua_toboolean(L, -1)) {
+      opt->sitedepth = LMP_SITE_DEPTH;
+    }
+    lua_getfield(L, 1, "hook");
+    opt->sitehook = lua_toboolean(L, -1);
+    if (opt->sitehook && opt->sitedepth == 0)
+      opt->sitedepth = LMP_SITE_DEPTH;
+    lua_getfield(L, 1, "leaks");
+    opt->leaks = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "collect");
+    collect = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "output");
+    if (!lua_isnil(L, -1)) {
+      size_t l;
+      if (!lua_isstring(L, -1))
+        luaL_error(L, "luamemprofiler output must be a file name");
+      opt->output = lua_tolstring(L, -1, &l);
+      if (l >= 4 && strcmp(opt->output + l - 4, ".csv") == 0)
+        opt->outputformat = LMP_OUTPUT_CSV;
+    }
+    lua_getfield(L, 1, "format");
+    if (!lua_isnil(L, -1)) {
+      const char *m = lua_tostring(L, -1);
+      if (m != NULL && strcmp(m, "json") == 0) {
+        opt->outputformat = LMP_OUTPUT_JSON;
+      } else if (m != NULL && strcmp(m, "csv") == 0) {
+        opt->outputformat = LMP_OUTPUT_CSV;
+      } else {
+        luaL_error(L, "invalid luamemprofiler format '%s'", m ? m : "?");
+      }
+    }
+    lua_getfield(L, 1, "trace");
+    if (!lua_isnil(L, -1)) {
+      if (!lua_isstring(L, -1))
+        luaL_error(L, "luamemprofiler trace must be a file name");
+      opt->trace = lua_tostring(L, -1);
+    }
+    lua_getfield(L, 1, "tracefull");
+    if (!lua_isnil(L, -1)) {
+      const char *m = lua_tostring(L, -1);
+      if (m != NULL && strcmp(m, "block") == 0) {
+        opt->tracepolicy = LMP_TRACE_BLOCK;
+      } else if (m != NULL && strcmp(m, "drop") == 0) {
+        opt->tracepolicy = LMP_TRACE_DROP;
+      } else if (m != NULL && strcmp(m, "sample") == 0) {
+        opt->tracepolicy = LMP_TRACE_SAMPLEFULL;
+      } else {
+        luaL_error(L, "invalid luamemprofiler tracefull '%s'", m ? m : "?");
+      }
+    }
+    lua_getfield(L, 1, "timeline");
+    if (lua_isnumber(L, -1)) {
+      opt->timeline = (long) lua_tonumber(L, -1);
+      if (opt->timeline <= 0)
+        luaL_error(L, "luamemprofiler timeline interval must be positive");
+    } else if (lua_toboolean(L, -1)) {
+      opt->timeline = LMP_TIMELINE_INTERVAL;
+    }
+    lua_getfield(L, 1, "timelinems");
+    if (!lua_isnil(L, -1)) {
+      opt->timelinems = (long) lua_tonumber(L, -1);
+      if (opt->timelinems <= 0)
+        luaL_error(L, "luamemprofiler timelinems must be positive");
+    }
+    lua_getfield(L, 1, "peak");
+    opt->peak = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "gc");
+    opt->gc = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "reallocs");
+    opt->reallocs = lua_toboolean(L, -1);
+    lua_pop(L, 18);
+  }
+
+  opt->usegraphics = opt->memused ? 1 : 0;
+  if (opt->mode != LMP_MODE_FULL && opt->usegraphics) {
+    luaL_error(L, "luamemprofiler graphical display requires 'full' mode");
+  }
+  if (opt->mode != LMP_MODE_FULL && opt->sitedepth > 0) {
+    luaL_error(L, "luamemprofiler allocation sites require 'full' mode");
+  }
+  if (opt->mode != LMP_MODE_FULL && opt->leaks) {
+    luaL_error(L, "luamemprofiler leak report requires 'full' mode");
+  }
+  if (opt->mode != LMP_MODE_FULL && opt->peak) {
+    luaL_error(L, "luamemprofiler peak report requires 'full' mode");
+  }
+  if (opt->mode != LMP_MODE_FULL && opt->reallocs) {
+    luaL_error(L, "luamemprofiler realloc report requires 'full' mode");
+  }
+
+  /* sites are taken from the main thread, start may run in a coroutine */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  opt->L = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  return collect;
+}
+
+/* sets the fields of a type counters table on the top */
+static void settypecounters (lua_State *L, lmp_TypeCounters *tc) {
+  lua_pushnumber(L, tc->nallocs);
+  lua_setfield(L, -2, "allocs");
+  lua_pushnumber(L, tc->live);
+  lua_setfield(L, -2, "live");
+  lua_pushnumber(L, tc->livesize);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, tc->maxlive);
+  lua_setfield(L, -2, "maxlive");
+  lua_pushnumber(L, tc->maxlivesize);
+  lua_setfield(L, -2, "maxbytes");
+}
+
+/*
+** sets the fields of the stats table on the top. Setting fields that
+** already exist does not allocate memory (keys are short strings, which
+** are reused).
+*/
+static void setstats (lua_State *L, lmp_Stats *st) {
+  int i;
+  lua_pushnumber(L, st->nallocs);
+  lua_setfield(L, -2, "allocs");
+  lua_pushnumber(L, st->alloc_size);
+  lua_setfield(L, -2, "allocbytes");
+  lua_pushnumber(L, st->nreallocs);
+  lua_setfield(L, -2, "reallocs");
+  lua_pushnumber(L, st->realloc_size);
+  lua_setfield(L, -2, "reallocbytes");
+  lua_pushnumber(L, st->nfrees);
+  lua_setfield(L, -2, "frees");
+  lua_pushnumber(L, st->free_size);
+  lua_setfield(L, -2, "freebytes");
+  lua_pushnumber(L, st->nallocs - st->nfrees);
+  lua_setfield(L, -2, "live");
+  lua_pushnumber(L, st->memoryuse);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, st->maxmemoryuse);
+  lua_setfield(L, -2, "peak");
+  lua_getfield(L, -1, "types");
+  for (i = 0; i < LMP_NTYPES; i++) {
+    lua_getfield(L, -1, typenames[i]);
+    settypecounters(L, &st->types[i]);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+/* creates the stats table (before the profiler starts, so it is not seen) */
+static void newstats (lua_State *L) {
+  lmp_Stats st;
+  int i;
+  memset(&st, 0, sizeof(st));
+  lua_createtable(L, 0, 10);
+  lua_createtable(L, 0, LMP_NTYPES);
+  for (i = 0; i < LMP_NTYPES; i++) {
+    lua_createtable(L, 0, 5);
+    lua_setfield(L, -2, typenames[i]);
+  }
+  lua_setfield(L, -2, "types");
+  setstats(L, &st);  /* creates all the fields */
+  lua_setfield(L, LUA_REGISTRYINDEX, "luamemprofiler_stats");
+}
+
+/*
+** creates the sentinel of the next garbage collection cycle: an unreachable
+** userdata, so its finalizer runs at the end of the cycle. The registry
+** keeps its address (a light userdata does not keep it alive), so the
+** sentinels left by a stopped profiler are told apart.
+*/
+static void newsentinel (lua_State *L) {
+  void *p = lua_newuserdata(L, 1);
+  luaL_setmetatable(L, SENTINEL_MT);
+  lua_pushlightuserdata(L, p);
+  lua_setfield(L, LUA_REGISTRYINDEX, "luamemprofiler_gc");
+  lua_pop(L, 1);
+}
+
+/* finalizer of the sentinels: a garbage collection cycle ended */
+static int gcsentinel (lua_State *L) {
+  lmp_Alloc *s;
+  void *armed;
+  lua_getfield(L, LUA_REGISTRYINDEX, "luamemprofiler_gc");
+  armed = lua_touserdata(L, -1);
+  lua_getfield(L, LUA_REGISTRYINDEX, "luamemprofiler_ud");
+  s = (lmp_Alloc *) lua_touserdata(L, -1);
+  if (armed == lua_touserdata(L, 1) && s != NULL && s->ctx != NULL) {
+    lmp_gccycle(s->ctx);
+    newsentinel(L);
+  }
+  return 0;
 }
 
 /* Main module function. Starts the library */
 static int luamemprofiler_start(lua_State *L) {
-  static lua_Alloc f;
-  static void *ud;
-
-  float memused;
-  int usegraphics = 0;
+  lua_Alloc f;
+  void *ud;
+  lmp_Alloc *s;
+  lmp_Options opt;
+  int collect;
 
   /* get the amount of memory expected to be used AND set enable graphics */
-  memused = (float) lua_tonumber(L, 1);
-  if (memused)
-    usegraphics = 1;
+  collect = getoptions(L, &opt);
 
   /* get default allocation function */
   f = lua_getallocf(L, &ud);
 
   /* check if start has been called before */
   if (f == lmp_alloc) {
-    /* restore default allocation function and remove library finalizer */
-    lmp_Alloc *s;
+    /* stop profiler and remove library finalizer */
     lua_getfield(L, LUA_REGISTRYINDEX, "luamemprofiler_ud");
     s = (lmp_Alloc *) lua_touserdata(L, -1);
-    lua_setallocf(L, s->f, s->ud);
+    stopprofiler(L, s);
     lua_getmetatable(L, -1);
     lua_pushnil(L);
     lua_setfield(L, -2, "__gc");
@@ -104,34 +446,286 @@ static int luamemprofiler_start(lua_State *L) {
     lua_error(L);
   }
 
+  if (opt.usegraphics && graphicsinuse) {
+    lua_pushstring(L, "luamemprofiler graphical display is already in use");
+    lua_error(L);
+  }
+
   /* create data_structure and set finalizer */
-  create_finalizer(L, f, ud);
-  lua_setallocf(L, lmp_alloc, ud);
+  s = create_finalizer(L, f, ud);
+  newstats(L);
 
   /* L is in most cases the lowest address of the heap (easiest to access) */
-  lmp_start((uintptr_t) L, memused, usegraphics);
+  s->ctx = lmp_start((uintptr_t) L, &opt, f, ud);
+  s->usegraphics = opt.usegraphics;
+  s->collect = collect;
+  graphicsinuse = graphicsinuse || opt.usegraphics;
+  lua_setallocf(L, lmp_alloc, s->ctx);  /* the context is lmp_alloc ud */
+  if (opt.gc)
+    newsentinel(L);
   return 0;
 }
 
-/* restore default allocation function and stop the other modules */
-static int luamemprofiler_stop(lua_State *L) {
+/* returns the 'alloc' userdata of a running profiler ('f' names the caller) */
+static lmp_Alloc *getprofiler(lua_State *L, const char *f) {
   lmp_Alloc *s;
-
-  /* get 'alloc' userdata and restore original allocation function */
   lua_pushstring(L, "luamemprofiler_ud");
   lua_rawget(L, LUA_REGISTRYINDEX);
   s = (lmp_Alloc*) lua_touserdata(L, -1);
-  if (s == NULL) {
-    lua_pushstring(L, "calling luamemprofiler stop function without calling start function");
-    lua_error(L);
+  if (s == NULL || s->ctx == NULL) {
+    luaL_error(L, "calling luamemprofiler %s function without calling start function", f);
   }
   lua_pop(L, 1);
-  lua_setallocf(L, s->f, s->ud);
+  return s;
+}
 
-  lmp_stop();
+/* restore default allocation function and stop the other modules */
+static int luamemprofiler_stop(lua_State *L) {
+  lmp_Alloc *s = getprofiler(L, "stop");
+  if (s->collect)  /* while profiling, so the collected blocks are freed */
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  stopprofiler(L, s);
   return 0;
 }
 
+/*
+** returns a table with one entry per type category, each one a table with
+** the fields 'allocs', 'live', 'bytes', 'maxlive' and 'maxbytes'.
+*/
+static int luamemprofiler_types(lua_State *L) {
+  lmp_TypeCounters tc[LMP_NTYPES];
+  int i;
+  /* read the counters before allocating the result tables */
+  lmp_gettypes(getprofiler(L, "types")->ctx, tc);
+  lua_createtable(L, 0, LMP_NTYPES);
+  for (i = 0; i < LMP_NTYPES; i++) {
+    lua_createtable(L, 0, 5);
+    settypecounters(L, &tc[i]);
+    lua_setfield(L, -2, typenames[i]);
+  }
+  return 1;
+}
+
+/*
+** returns the current counters. The table is the same on every call, its
+** fields are overwritten, so the call allocates no memory.
+*/
+static int luamemprofiler_stats(lua_State *L) {
+  lmp_Stats st;
+  lmp_getstats(getprofiler(L, "stats")->ctx, &st);
+  lua_getfield(L, LUA_REGISTRYINDEX, "luamemprofiler_stats");
+  setstats(L, &st);
+  return 1;
+}
+
+
+/*
+** returns a snapshot handle. Its cost is proportional to the number of
+** sites, not of blocks. The handle itself is allocated before the counters
+** are read, so it is part of the snapshot.
+*/
+static int luamemprofiler_snapshot(lua_State *L) {
+  lmp_Alloc *s = getprofiler(L, "snapshot");
+  unsigned int n = lmp_nsites(s->ctx);
+  lmp_SnapshotUd *snap = (lmp_SnapshotUd *) lua_newuserdata(L,
+                          sizeof(lmp_SnapshotUd) + n * sizeof(lmp_Live));
+  snap->nsites = lmp_snapshot(s->ctx, &snap->total, snap->types,
+                                      snap->sites, n);
+  luaL_setmetatable(L, SNAPSHOT_MT);
+  return 1;
+}
+
+/* sets the fields 'live' and 'bytes' of the table on the top */
+static void setlive (lua_State *L, long live, long livesize) {
+  lua_pushnumber(L, live);
+  lua_setfield(L, -2, "live");
+  lua_pushnumber(L, livesize);
+  lua_setfield(L, -2, "bytes");
+}
+
+/* orders site differences by bytes (largest growth first) */
+static int sitediffcmp (const void *a, const void *b) {
+  long sa = ((const lmp_SiteDiff *) a)->livesize;
+  long sb = ((const lmp_SiteDiff *) b)->livesize;
+  return (sa < sb) - (sa > sb);
+}
+
+/* sets t[i] = {site = frames, live = n, bytes = n}, t on the top */
+static void pushsitediff (lua_State *L, lmp_Context *ctx, lmp_SiteDiff *d,
+                                                          int i) {
+  char name[SITENAME_SIZE];
+  lua_createtable(L, 0, 3);
+  lmp_sitename(ctx, d->site, name, sizeof(name));
+  lua_pushstring(L, name);
+  lua_setfield(L, -2, "site");
+  setlive(L, d->live, d->livesize);
+  lua_rawseti(L, -2, i);
+}
+
+/*
+** lmp.diff(a, b): returns b - a as a table with the fields 'live' and
+** 'bytes' (total), 'types' (changed types, by name) and 'grew' and 'shrank'
+** (arrays of changed sites {site = frames, live = n, bytes = n}, the
+** largest changes first).
+*/
+static int luamemprofiler_diff(lua_State *L) {
+  lmp_Alloc *s = getprofiler(L, "diff");
+  lmp_SnapshotUd *a = (lmp_SnapshotUd *) luaL_checkudata(L, 1, SNAPSHOT_MT);
+  lmp_SnapshotUd *b = (lmp_SnapshotUd *) luaL_checkudata(L, 2, SNAPSHOT_MT);
+  unsigned int i, n = 0, nsites = a->nsites > b->nsites ? a->nsites
+                                                        : b->nsites;
+  int ngrew = 0, nshrank = 0;
+  lmp_SiteDiff *d;
+
+  /* changed sites (a site missing in a snapshot was not created yet) */
+  d = (lmp_SiteDiff *) lua_newuserdata(L, nsites * sizeof(lmp_SiteDiff) + 1);
+  for (i = 0; i < nsites; i++) {
+    long live = 0, livesize = 0;
+    if (i < b->nsites) {
+      live = b->sites[i].live;
+      livesize = b->sites[i].livesize;
+    }
+    if (i < a->nsites) {
+      live -= a->sites[i].live;
+      livesize -= a->sites[i].livesize;
+    }
+    if (live != 0 || livesize != 0) {
+      d[n].site = i;
+      d[n].live = live;
+      d[n].livesize = livesize;
+      n++;
+    }
+  }
+  qsort(d, n, sizeof(lmp_SiteDiff), sitediffcmp);
+
+  lua_createtable(L, 0, 5);
+  setlive(L, b->total.live - a->total.live,
+             b->total.livesize - a->total.livesize);
+  lua_newtable(L);
+  for (i = 0; i < LMP_NTYPES; i++) {
+    long live = b->types[i].live - a->types[i].live;
+    long livesize = b->types[i].livesize - a->types[i].livesize;
+    if (live != 0 || livesize != 0) {
+      lua_createtable(L, 0, 2);
+      setlive(L, live, livesize);
+      lua_setfield(L, -2, typenames[i]);
+    }
+  }
+  lua_setfield(L, -2, "types");
+  lua_newtable(L);
+  for (i = 0; i < n; i++) {  /* largest growth first */
+    if (!SHRANK(&d[i]))
+      pushsitediff(L, s->ctx, &d[i], ++ngrew);
+  }
+  lua_setfield(L, -2, "grew");
+  lua_newtable(L);
+  for (i = n; i-- > 0; ) {  /* largest shrink first */
+    if (SHRANK(&d[i]))
+      pushsitediff(L, s->ctx, &d[i], ++nshrank);
+  }
+  lua_setfield(L, -2, "shrank");
+  return 1;
+}
+
+/* lmp.mark(label): adds a labelled mark to the timeline */
+static int luamemprofiler_mark(lua_State *L) {
+  lmp_Alloc *s = getprofiler(L, "mark");
+  if (!lmp_mark(s->ctx, luaL_checkstring(L, 1)))
+    luaL_error(L, "luamemprofiler mark requires the timeline option");
+  return 0;
+}
+
+/* sets the fields of a timeline point or mark on the top */
+static void settimefields (lua_State *L, long nops, double time,
+                                        long memoryuse) {
+  lua_pushnumber(L, nops);
+  lua_setfield(L, -2, "operations");
+  lua_pushnumber(L, time);
+  lua_setfield(L, -2, "seconds");
+  lua_pushnumber(L, memoryuse);
+  lua_setfield(L, -2, "bytes");
+}
+
+/*
+** lmp.timeline(): returns {every = n, unit = "operations" | "ms",
+** points = {{operations, seconds, bytes, peak, string, ..., other}, ...},
+** marks = {{label, operations, seconds, bytes}, ...}}. The last point is
+** the current moment. The points are copied into a userdata before the
+** tables are created, so they do not see the memory of the result.
+*/
+static int luamemprofiler_timeline(lua_State *L) {
+  lmp_Alloc *s = getprofiler(L, "timeline");
+  lmp_TimePoint *p = (lmp_TimePoint *) lua_newuserdata(L,
+                     (LMP_TIMELINE_SIZE + 1) * sizeof(lmp_TimePoint) +
+                     LMP_TIMELINE_MARKS * sizeof(lmp_TimeMark));
+  lmp_TimeMark *m = (lmp_TimeMark *) (p + LMP_TIMELINE_SIZE + 1);
+  long interval;
+  int i, j, n, nmarks, clock;
+  n = lmp_gettimeline(s->ctx, p, m, &nmarks, &interval, &clock);
+  if (n == 0)
+    luaL_error(L, "luamemprofiler timeline requires the timeline option");
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, interval);
+  lua_setfield(L, -2, "every");
+  lua_pushstring(L, clock ? "ms" : "operations");
+  lua_setfield(L, -2, "unit");
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_createtable(L, 0, 4 + LMP_NTYPES);
+    settimefields(L, p[i].nops, p[i].time, p[i].memoryuse);
+    lua_pushnumber(L, p[i].peak);
+    lua_setfield(L, -2, "peak");
+    for (j = 0; j < LMP_NTYPES; j++) {
+      lua_pushnumber(L, p[i].types[j]);
+      lua_setfield(L, -2, typenames[j]);
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "points");
+  lua_createtable(L, nmarks, 0);
+  for (i = 0; i < nmarks; i++) {
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, m[i].label);
+    lua_setfield(L, -2, "label");
+    settimefields(L, m[i].nops, m[i].time, m[i].memoryuse);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "marks");
+  return 1;
+}
+
+/*
+** writes a merged report of all running threadsafe lua_States and returns
+** its counters: {states, allocs, allocbytes, reallocs, reallocbytes, frees,
+** freebytes, live, bytes, summax (sum of the maximum of each lua_State)}
+*/
+static int luamemprofiler_report(lua_State *L) {
+  lmp_Stats st;
+  int n = lmp_report(&st);
+  lua_createtable(L, 0, 10);
+  lua_pushnumber(L, n);
+  lua_setfield(L, -2, "states");
+  lua_pushnumber(L, st.nallocs);
+  lua_setfield(L, -2, "allocs");
+  lua_pushnumber(L, st.alloc_size);
+  lua_setfield(L, -2, "allocbytes");
+  lua_pushnumber(L, st.nreallocs);
+  lua_setfield(L, -2, "reallocs");
+  lua_pushnumber(L, st.realloc_size);
+  lua_setfield(L, -2, "reallocbytes");
+  lua_pushnumber(L, st.nfrees);
+  lua_setfield(L, -2, "frees");
+  lua_pushnumber(L, st.free_size);
+  lua_setfield(L, -2, "freebytes");
+  lua_pushnumber(L, st.nallocs - st.nfrees);
+  lua_setfield(L, -2, "live");
+  lua_pushnumber(L, st.memoryuse);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, st.maxmemoryuse);
+  lua_setfield(L, -2, "summax");
+  return 1;
+}
+
 
 /**********************************
  * register structs and functions *
@@ -141,11 +735,24 @@ static int luamemprofiler_stop(lua_State *L) {
 static const luaL_Reg luamemprofiler[] = {
   { "start", luamemprofiler_start},
   { "stop", luamemprofiler_stop},
+  { "report", luamemprofiler_report},
+  { "types", luamemprofiler_types},
+  { "stats", luamemprofiler_stats},
+  { "snapshot", luamemprofiler_snapshot},
+  { "diff", luamemprofiler_diff},
+  { "mark", luamemprofiler_mark},
+  { "timeline", luamemprofiler_timeline},
   { NULL, NULL }
 };
 
 /* register luamemprofiler functions */
 LUALIB_API int luaopen_luamemprofiler (lua_State *L) {
+  luaL_newmetatable(L, SNAPSHOT_MT);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, SENTINEL_MT);
+  lua_pushcfunction(L, gcsentinel);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
   luaL_newlib(L, luamemprofiler);
   return 1;
 }
@@ -0,0 +1,15 @@
+-- See Copyright Notice in COPYRIGHT
+-- option gc: each full collection ends one cycle
+
+local lmp = require"luamemprofiler"
+collectgarbage()
+
+lmp.start{gc = true}
+local t = {}
+for i=1,4 do
+  t[i] = {}
+end
+collectgarbage()
+t = nil
+collectgarbage()
+lmp.stop()
@@ -0,0 +1,12 @@
+-- See Copyright Notice in COPYRIGHT
+-- option leaks: every block is still alive at stop
+
+local lmp = require"luamemprofiler"
+collectgarbage()  -- no collection step while profiling
+
+lmp.start{leaks = true}
+local t = {}
+for i=1,4 do
+  t[i] = {}
+end
+lmp.stop()
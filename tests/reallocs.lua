@@ -0,0 +1,12 @@
+-- See Copyright Notice in COPYRIGHT
+-- options reallocs and peak: the array of the table grows 5 times
+
+local lmp = require"luamemprofiler"
+collectgarbage()  -- no collection step while profiling
+
+lmp.start{reallocs = true, peak = true}
+local t = {}
+for i=10,200,10 do
+  table.insert(t, i)
+end
+lmp.stop()
@@ -0,0 +1,229 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** Stress test for threadsafe profiling: runs an allocation heavy script in
+** N lua_States at once, one per OS thread, each one profiled with
+** lmp.start{threadsafe=true}, while the main thread asks for merged reports.
+** When all workers are done allocating they stop at a barrier, the main
+** thread takes a merged report (lmp.report) and the workers read their own
+** counters (lmp.stats) before going on. A worker whose script fails before
+** the barrier still meets the main thread there, so the test never hangs.
+** The test fails (exit status 1) if a script fails, if the counters of a lua_State are not consistent (live
+** bytes = allocated + reallocated - freed, never negative) or if the merged
+** report is not the sum of the lua_States. It also prints the throughput
+** with 1 thread and with N threads, which should scale with the number of
+** cores.
+**
+** usage (from the repository root): tests/stress [nthreads] [iterations]
+*/
+
+#define _XOPEN_SOURCE 600  /* pthread_barrier_t */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+/* counters compared, in the order the worker script returns them */
+#define NCOUNTERS 8
+static const char *const counters[NCOUNTERS] = {
+  "allocs", "allocbytes", "reallocs", "reallocbytes",
+  "frees", "freebytes", "live", "bytes"
+};
+
+static const char *worker_script =
+  "package.cpath = './?.so;' .. package.cpath\n"
+  "local lmp = require'luamemprofiler'\n"
+  "local n, wait = ...\n"
+  "lmp.start{threadsafe = true}\n"
+  "local t = {}\n"
+  "for i = 1, n do\n"
+  "  local s = 'key' .. i\n"
+  "  t[i % 1000] = {s, i, {i}}\n"
+  "  if i % 100 == 0 then table.insert(t, s:rep(3)) end\n"
+  "end\n"
+  "wait()  -- the main thread merges the counters meanwhile\n"
+  "local st = lmp.stats()\n"
+  "local allocs, allocbytes = st.allocs, st.allocbytes\n"
+  "local reallocs, reallocbytes = st.reallocs, st.reallocbytes\n"
+  "local frees, freebytes, live, bytes = st.frees, st.freebytes, st.live,"
+  " st.bytes\n"
+  "lmp.stop()\n"
+  "return allocs, allocbytes, reallocs, reallocbytes, frees, freebytes,"
+  " live, bytes\n";
+
+static const char *report_script =
+  "package.cpath = './?.so;' .. package.cpath\n"
+  "return require'luamemprofiler'.report()\n";
+
+static int iterations = 200000;
+
+/* workers and main thread meet twice: before and after the merged report */
+static pthread_barrier_t barrier;
+
+/* a worker and the counters of its lua_State at the barrier */
+typedef struct worker {
+  pthread_t thread;
+  double counts[NCOUNTERS];
+  int ok;
+  int waited;  /* its script called waitmerge */
+} Worker;
+
+
+/* meets the main thread at the barrier, before and after the merge */
+static void meet (void) {
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+}
+
+/*
+** called by the workers (upvalue: the Worker): waits until the main
+** thread merged the counters
+*/
+static int waitmerge (lua_State *L) {
+  Worker *w = (Worker *) lua_touserdata(L, lua_upvalueindex(1));
+  w->waited = 1;
+  meet();
+  return 0;
+}
+
+/*
+** runs a script in a new lua_State with the arguments 'n' and waitmerge,
+** and copies its first 'nresults' results (numbers) to 'v' or, if the
+** script returns a table, its fields named by 'counters'. Returns 0 if the
+** script fails; then, if it is the script of worker 'w' and it did not
+** reach waitmerge, meets the main thread in its place.
+*/
+static int runscript (const char *script, int n, double *v, int nresults,
+                                                            Worker *w) {
+  int i, ok = 1;
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  if (luaL_loadstring(L, script) != LUA_OK) {
+    fprintf(stderr, "stress: %s\n", lua_tostring(L, -1));
+    lua_close(L);
+    if (w != NULL)
+      meet();
+    return 0;
+  }
+  lua_pushinteger(L, n);
+  lua_pushlightuserdata(L, w);
+  lua_pushcclosure(L, waitmerge, 1);
+  if (lua_pcall(L, 2, nresults, 0) != LUA_OK) {
+    fprintf(stderr, "stress: %s\n", lua_tostring(L, -1));
+    ok = 0;
+  } else if (nresults == 1) {
+    for (i = 0; i < NCOUNTERS; i++) {
+      lua_getfield(L, -1, counters[i]);
+      v[i] = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+    lua_getfield(L, -1, "states");
+    v[NCOUNTERS] = lua_tonumber(L, -1);
+  } else {
+    for (i = 0; i < nresults; i++)
+      v[i] = lua_tonumber(L, i - nresults);
+  }
+  lua_close(L);
+  if (!ok && w != NULL && !w->waited)
+    meet();
+  return ok;
+}
+
+static void *worker (void *arg) {
+  Worker *w = (Worker *) arg;
+  w->ok = runscript(worker_script, iterations, w->counts, NCOUNTERS, w);
+  return NULL;
+}
+
+static double now () {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* checks the counters of a lua_State; returns the number of errors */
+static int checkstate (int i, const double *c) {
+  /* c: allocs allocbytes reallocs reallocbytes frees freebytes live bytes */
+  if (c[7] != c[1] + c[3] - c[5] || c[7] < 0 || c[6] < 0 ||
+      c[6] != c[0] - c[4]) {
+    fprintf(stderr, "stress: lua_State %d: inconsistent counters "
+            "(live=%.0f bytes=%.0f)\n", i, c[6], c[7]);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** runs n workers at once and returns the elapsed time, or a negative
+** number if any check failed
+*/
+static double run (int n) {
+  int i, j, failed = 0, errors = 0;
+  double merged[NCOUNTERS + 1], t0 = now();
+  Worker *w = (Worker *) calloc(n, sizeof(Worker));
+  memset(merged, 0, sizeof(merged));
+  pthread_barrier_init(&barrier, NULL, n + 1);
+  for (i = 0; i < n; i++)
+    pthread_create(&w[i].thread, NULL, worker, &w[i]);
+  for (i = 0; i < 3; i++)  /* merged reports while workers run */
+    errors += !runscript(report_script, 0, merged, 1, NULL);
+  pthread_barrier_wait(&barrier);  /* all workers are waiting (or failed) */
+  errors += !runscript(report_script, 0, merged, 1, NULL);
+  pthread_barrier_wait(&barrier);
+  for (i = 0; i < n; i++)
+    pthread_join(w[i].thread, NULL);
+  pthread_barrier_destroy(&barrier);
+
+  for (i = 0; i < n; i++) {
+    if (!w[i].ok) {
+      fprintf(stderr, "stress: the script of lua_State %d failed\n", i);
+      failed++;
+    }
+  }
+  if (failed > 0) {  /* the merged report is not the sum of the workers */
+    free(w);
+    return -1;
+  }
+  if (merged[NCOUNTERS] != n) {
+    fprintf(stderr, "stress: merged %.0f lua_States, expected %d\n",
+            merged[NCOUNTERS], n);
+    errors++;
+  }
+  for (i = 0; i < n; i++) {
+    errors += checkstate(i, w[i].counts);
+    for (j = 0; j < NCOUNTERS; j++)
+      merged[j] -= w[i].counts[j];
+  }
+  for (j = 0; j < NCOUNTERS; j++) {
+    if (merged[j] != 0) {
+      fprintf(stderr, "stress: merged %s differs from the sum of the "
+              "lua_States by %.0f\n", counters[j], merged[j]);
+      errors++;
+    }
+  }
+  free(w);
+  return errors == 0 ? now() - t0 : -1;
+}
+
+int main (int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 4;
+  double t1, tn;
+  if (argc > 2)
+    iterations = atoi(argv[2]);
+
+  t1 = run(1);
+  tn = run(n);
+  if (t1 < 0 || tn < 0) {
+    fprintf(stderr, "stress: FAILED\n");
+    return 1;
+  }
+  fprintf(stderr, "stress: 1 thread %.0f it/s, %d threads %.0f it/s (x%.2f)\n",
+          iterations / t1, n, n * iterations / tn, (n * t1) / tn);
+  return 0;
+}
@@ -0,0 +1,14 @@
+-- See Copyright Notice in COPYRIGHT
+-- option timeline: a point every 2 operations and a mark
+
+local lmp = require"luamemprofiler"
+collectgarbage()  -- no collection step while profiling
+
+lmp.start{timeline = 2}
+local t = {}
+for i=1,4 do
+  t[i] = {}
+end
+lmp.mark("filled")
+t[5] = {}
+lmp.stop()
@@ -0,0 +1,246 @@
+/*
+**
+** See Copyright Notice in COPYRIGHT
+**
+** Round trip test of the binary trace (src/lmp_trace.h): writes a trace of
+** pseudo random operations with tr_malloc, tr_realloc, tr_free and tr_site
+** and reads it back with tr_read and tr_seek, comparing every record field
+** by field. The operations mix addresses close to each other, aligned and
+** not, and addresses far apart (large deltas, both ways), and there are
+** several keyframes. A copy of the trace cut in the middle must read the
+** same records up to the cut, then end (or fail) without crashing.
+** It does not need Lua. Exits with status 1 on the first difference.
+**
+** usage (from the repository root): tests/trace [file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lmp_trace.h"
+
+#define NEVENTS (3 * LMP_TRACE_KEYFRAME + 1234)
+#define NSITES 50
+
+/* an operation written in the trace */
+typedef struct op {
+  int kind;
+  uintptr_t ptr, nptr;
+  size_t osize, nsize;
+  int type;
+  unsigned int site;
+} Op;
+
+static Op ops[NEVENTS];
+static char where[NSITES + 1][32];
+static unsigned int parent[NSITES + 1];
+static int failed = 0;
+
+static unsigned long seed = 12345;
+
+static unsigned long next (void) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return seed >> 33;
+}
+
+/* an address: near the previous one, aligned or not, or far away */
+static uintptr_t address (uintptr_t prev) {
+  switch (next() % 8) {
+    case 0:
+      return (uintptr_t) 0x7ffff0000000UL + next() * 16;  /* far, high */
+    case 1:
+      return (uintptr_t) 0x1000 + next() % 4096;  /* far, low, unaligned */
+    case 2:
+      return prev + 1 + next() % 64;  /* near, unaligned */
+    default:
+      return (prev & ~(uintptr_t) 15) + 16 * (next() % 256);  /* aligned */
+  }
+}
+
+static size_t size (void) {
+  return next() % 16 == 0 ? (size_t) next() << 8 : next() % 1024;
+}
+
+static void fail (const char *what, long number) {
+  fprintf(stderr, "trace: %s differs at event %ld\n", what, number);
+  failed = 1;
+}
+
+/* compares a record read with the operation written */
+static void compare (const lmp_TraceEvent *ev, const Op *op, long number) {
+  if (ev->kind != op->kind) fail("kind", number);
+  else if (ev->number != number) fail("number", number);
+  else if (ev->ptr != op->ptr) fail("address", number);
+  else if (op->kind == LMP_TRACE_REALLOC && ev->nptr != op->nptr)
+    fail("new address", number);
+  else if (op->kind != LMP_TRACE_MALLOC && ev->osize != op->osize)
+    fail("old size", number);
+  else if (op->kind != LMP_TRACE_FREE && ev->nsize != op->nsize)
+    fail("new size", number);
+  else if (op->kind == LMP_TRACE_MALLOC &&
+           (ev->type != op->type || ev->site != op->site))
+    fail("type or site", number);
+}
+
+static void writetrace (const char *path) {
+  uintptr_t prev = 0x55550000;
+  unsigned int nsites = 0;
+  long i;
+  lmp_Trace *t = tr_open(path, LMP_TRACE_SITES, LMP_TRACE_BLOCK);
+  if (t == NULL) {
+    fprintf(stderr, "trace: cannot create %s\n", path);
+    exit(1);
+  }
+  for (i = 0; i < NEVENTS; i++) {
+    Op *op = &ops[i];
+    op->kind = (int) (next() % 3);
+    op->ptr = address(prev);
+    switch (op->kind) {
+      case LMP_TRACE_MALLOC:
+        if (nsites < NSITES && next() % 1000 == 0) {  /* a new site */
+          nsites++;
+          parent[nsites] = (unsigned int) (next() % nsites);
+          sprintf(where[nsites], "f%u.lua:%lu", nsites, next() % 1000);
+          tr_site(t, parent[nsites], where[nsites]);
+        }
+        op->nsize = size();
+        op->type = (int) (next() % 6);
+        op->site = (unsigned int) (next() % (nsites + 1));
+        tr_malloc(t, (void *) op->ptr, op->nsize, op->type, op->site);
+        break;
+      case LMP_TRACE_FREE:
+        op->osize = size();
+        tr_free(t, (void *) op->ptr, op->osize);
+        break;
+      case LMP_TRACE_REALLOC:
+        op->nptr = next() % 2 ? op->ptr : address(op->ptr);
+        op->osize = size();
+        op->nsize = size();
+        tr_realloc(t, (void *) op->ptr, (void *) op->nptr, op->osize,
+                   op->nsize);
+        break;
+    }
+    prev = op->kind == LMP_TRACE_REALLOC ? op->nptr : op->ptr;
+  }
+  tr_close(t);
+}
+
+/*
+** reads the whole trace and returns the number of events read; 'kind'
+** gets the result of the last tr_read. No event may be lost.
+*/
+static long readtrace (const char *path, int *kind) {
+  lmp_TraceEvent ev;
+  unsigned int nsites = 0;
+  long n = 0, dropped, sampled;
+  int flags;
+  lmp_TraceReader *r = tr_openreader(path, &flags);
+  if (r == NULL) {
+    fprintf(stderr, "trace: cannot read %s\n", path);
+    exit(1);
+  }
+  if (flags != LMP_TRACE_SITES)
+    fail("flags", 0);
+  while (!failed && (*kind = tr_read(r, &ev)) >= 0) {
+    if (*kind == LMP_TRACE_SITE) {
+      nsites++;
+      if (ev.site != nsites || ev.parent != parent[nsites] ||
+          strcmp(ev.where, where[nsites]) != 0)
+        fail("site", n);
+    } else if (n >= NEVENTS) {
+      fail("count", n);
+    } else {
+      compare(&ev, &ops[n], n);
+      n++;
+    }
+  }
+  if (*kind == LMP_TRACE_END) {
+    tr_losses(r, &dropped, &sampled);
+    if (dropped != 0 || sampled != 0)
+      fail("losses", n);
+  }
+  tr_closereader(r);
+  return n;
+}
+
+/* seeks to some events, with the index, and compares what follows */
+static void seektrace (const char *path) {
+  static const long targets[] = {
+    0, 1, LMP_TRACE_KEYFRAME - 1, LMP_TRACE_KEYFRAME, LMP_TRACE_KEYFRAME + 1,
+    2 * LMP_TRACE_KEYFRAME + 77, NEVENTS - 1, 100
+  };
+  lmp_TraceEvent ev;
+  size_t i;
+  lmp_TraceReader *r = tr_openreader(path, NULL);
+  for (i = 0; r != NULL && i < sizeof(targets) / sizeof(targets[0]); i++) {
+    long n = targets[i];
+    int kind;
+    if (!tr_seek(r, n)) {
+      fail("seek", n);
+      break;
+    }
+    while ((kind = tr_read(r, &ev)) == LMP_TRACE_SITE) ;
+    if (kind < 0)
+      fail("read after seek", n);
+    else
+      compare(&ev, &ops[n], n);
+  }
+  if (r != NULL) {
+    if (tr_seek(r, NEVENTS))
+      fail("seek past the end", NEVENTS);
+    tr_closereader(r);
+  }
+}
+
+/* copies the first half of the trace and reads it */
+static void truncatedtrace (const char *path) {
+  char cut[1024];
+  FILE *in = fopen(path, "rb"), *out;
+  long len, i, n;
+  int kind, c;
+  sprintf(cut, "%.1000s.cut", path);
+  out = fopen(cut, "wb");
+  if (in == NULL || out == NULL) {
+    fprintf(stderr, "trace: cannot copy %s\n", path);
+    exit(1);
+  }
+  fseek(in, 0, SEEK_END);
+  len = ftell(in);
+  rewind(in);
+  for (i = 0; i < len / 2 && (c = getc(in)) != EOF; i++)
+    putc(c, out);
+  fclose(in);
+  fclose(out);
+  n = readtrace(cut, &kind);
+  if (failed || n == 0 || n >= NEVENTS)
+    fail("truncated trace", n);
+  else {
+    lmp_TraceReader *r = tr_openreader(cut, NULL);
+    if (r == NULL || tr_seek(r, 0))
+      fail("seek without index", 0);
+    if (r != NULL)
+      tr_closereader(r);
+  }
+  remove(cut);
+}
+
+int main (int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "tests/trace.bin";
+  long n;
+  int kind;
+
+  writetrace(path);
+  n = readtrace(path, &kind);
+  if (!failed && (n != NEVENTS || kind != LMP_TRACE_END))
+    fail("end of the trace", n);
+  if (!failed)
+    seektrace(path);
+  if (!failed)
+    truncatedtrace(path);
+  remove(path);
+  if (failed)
+    return 1;
+  fprintf(stderr, "trace: %d events written and read back\n", NEVENTS);
+  return 0;
+}